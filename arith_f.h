@@ -1,104 +1,271 @@
 #pragma once
+#include <algorithm>
 #include <cassert>
+#include <map>
+#include "dense_matrix.h"
+#include "factored_fraction.h"
 #include "matrix.h"
+#include "metrics.h"
 #include "polynomial.h"
 using namespace std;
 
-Univariate X, U, Z;
-Fraction<Univariate> x, u, z;
+/* Build with -DFARITH_FACTORED_DENOMINATORS=1 to run FArith over FactoredFraction */
+#ifndef FARITH_FACTORED_DENOMINATORS
+#define FARITH_FACTORED_DENOMINATORS 0
+#endif
+
+#if FARITH_FACTORED_DENOMINATORS
+typedef FactoredFraction FArithScalar;
+#else
+typedef Fraction<Univariate> FArithScalar;
+#endif
 
-std::chrono::duration<float> v1, v2;
+Univariate X, U, Z;
+FArithScalar x, u, z;
 
-typedef Matrix<Fraction<Univariate>> FArithMatrix;
+typedef Matrix<FArithScalar> FArithMatrix;
 
 struct FArith {
     FArithMatrix A;
     FArithMatrix u;
 
-    Fraction<Univariate> get_fraction() const {
-        auto id = identity<Fraction<Univariate>>(A.nbRows());
-        auto t0 = std::chrono::high_resolution_clock::now();
+    FArithScalar get_fraction() const {
+        auto id = identity<FArithScalar>(A.nbRows());
+        MetricTimer inverse_timer(METRIC_FRACTION_INVERSE);
         auto mat = inverse(id - A);
-        auto t1 = std::chrono::high_resolution_clock::now();
-        auto res = single_product_element(mat, u, 0, 0);
-        auto t2 = std::chrono::high_resolution_clock::now();
-
-        v1 += t1 - t0;
-        v2 += t2 - t1;
+        inverse_timer.stop();
 
+        MetricTimer simplify_timer(METRIC_FRACTION_SIMPLIFY);
+        auto res = single_product_element(mat, u, 0, 0);
+#if !FARITH_FACTORED_DENOMINATORS
+        res.normalize();
+#endif
         return res;
     }
 
-    void remove_row(size_t row) {
-        FArithMatrix nA(A.coeffs.size() - 1, A.coeffs.size() - 1);
-        FArithMatrix nu(A.coeffs.size() - 1, 1);
-
-        size_t nRow = 0;
-        for(size_t iRow = 0;iRow < A.coeffs.size();iRow++) {
-            if(iRow == row)
-                continue;
-
-            nu.coeffs[nRow].setCoeff(0, u.coeffs[iRow].getCoeff(0));
+    /* Keeps the states whose `keep` flag is set, in one pass */
+    void remove_rows(const vector<bool>& keep) {
+        vector<size_t> new_ids(A.nbRows(), 0);
+        size_t nb_kept = 0;
+        for(size_t iRow = 0;iRow < A.nbRows();iRow++) {
+            if(keep[iRow]) {
+                new_ids[iRow] = nb_kept++;
+            }
+        }
 
-            size_t nCol = 0;
-            for(size_t iCol = 0;iCol < A.coeffs.size();iCol++) {
-                if(iCol == row)
-                    continue;
+        FArithMatrix nA(nb_kept, nb_kept);
+        FArithMatrix nu(nb_kept, 1);
 
-                nA.coeffs[nRow].setCoeff(nCol, A.coeffs[iRow].getCoeff(iCol));
+        for(size_t iRow = 0;iRow < A.nbRows();iRow++) {
+            if(!keep[iRow])
+                continue;
 
-                nCol++;
+            vector<pair<size_t, FArithScalar>> row;
+            for(auto& coeff : A.coeffs[iRow].coeffs) {
+                if(keep[coeff.first]) {
+                    row.push_back({new_ids[coeff.first], coeff.second});
+                }
             }
-            nRow++;
+            nA.coeffs[new_ids[iRow]] = MatrixRow<FArithScalar>(row);
+            nu.coeffs[new_ids[iRow]] = u.coeffs[iRow];
         }
 
         A = nA;
         u = nu;
     }
 
-    void simplify() {
-        for(size_t iCol = 1;iCol < A.nbCols();iCol++) {
-            bool is_col_zero = true;
+    void remove_row(size_t row) {
+        vector<bool> keep(A.nbRows(), true);
+        keep[row] = false;
+        remove_rows(keep);
+    }
+
+    /*
+     * States reachable from 0 through nonzero entries of A, and from which a
+     * state with a nonzero u is reachable. The others never contribute.
+     */
+    vector<bool> useful_states() const {
+        size_t nb_states = A.nbRows();
+        vector<vector<size_t>> predecessors(nb_states);
+        for(size_t iRow = 0;iRow < nb_states;iRow++) {
+            for(auto& coeff : A.coeffs[iRow].coeffs) {
+                predecessors[coeff.first].push_back(iRow);
+            }
+        }
 
-            for(size_t iRow = 0;is_col_zero && iRow < A.nbRows();iRow++) {
-                if(iRow != iCol && !is_zero(A.coeffs[iRow].getCoeff(iCol))) {
-                    is_col_zero = false;
+        vector<bool> reachable(nb_states, false);
+        vector<size_t> stack = {0};
+        reachable[0] = true;
+        while(!stack.empty()) {
+            size_t state = stack.back();
+            stack.pop_back();
+            for(auto& coeff : A.coeffs[state].coeffs) {
+                if(!reachable[coeff.first]) {
+                    reachable[coeff.first] = true;
+                    stack.push_back(coeff.first);
                 }
             }
+        }
 
-            if(is_col_zero) {
-                remove_row(iCol);
-                simplify();
-                return;
+        vector<bool> productive(nb_states, false);
+        for(size_t iRow = 0;iRow < nb_states;iRow++) {
+            if(!is_zero(u.coeffs[iRow].getCoeff(0))) {
+                productive[iRow] = true;
+                stack.push_back(iRow);
+            }
+        }
+        while(!stack.empty()) {
+            size_t state = stack.back();
+            stack.pop_back();
+            for(size_t pred : predecessors[state]) {
+                if(!productive[pred]) {
+                    productive[pred] = true;
+                    stack.push_back(pred);
+                }
             }
         }
 
-        FArithMatrix new_mat = transpose(A);
-        new_mat.coeffs.push_back(transpose(u).coeffs[0]);
-        new_mat = transpose(new_mat);
+        vector<bool> useful(nb_states, false);
+        for(size_t iRow = 0;iRow < nb_states;iRow++) {
+            useful[iRow] = reachable[iRow] && productive[iRow];
+        }
+        useful[0] = true;
+        return useful;
+    }
 
-        FArithMatrix basis = kernel_basis(new_mat);
+    void prune() {
+        vector<bool> useful = useful_states();
+        if(find(useful.begin(), useful.end(), false) != useful.end()) {
+            remove_rows(useful);
+        }
+    }
 
-        if(basis.nbRows() == 0) {
-            return;
+    /*
+     * Whether [A|u] has full row rank once X is replaced by `point`. If so, it
+     * also has full row rank over the fractions, and no state can be merged.
+     * Inconclusive (false) when a denominator vanishes at `point`.
+     */
+    bool has_trivial_kernel_at(const Mod& point) const {
+        Matrix<Mod> evaluated(A.nbRows(), A.nbCols() + 1);
+        for(size_t iRow = 0;iRow < A.nbRows();iRow++) {
+            vector<pair<size_t, Mod>> row;
+            row.reserve(A.coeffs[iRow].size() + 1);
+            Mod value = 0;
+            for(auto& coeff : A.coeffs[iRow].coeffs) {
+                if(!evaluate(coeff.second, point, value)) {
+                    return false;
+                }
+                row.push_back({coeff.first, value});
+            }
+            if(!evaluate(u.coeffs[iRow].getCoeff(0), point, value)) {
+                return false;
+            }
+            row.push_back({A.nbCols(), value});
+            evaluated.coeffs[iRow] = MatrixRow<Mod>(row);
         }
+        return matrix_rank(evaluated) == A.nbRows();
+    }
 
-        size_t row = basis.coeffs[0].coeffs[0].first;
-        if(row == 0)
-            row = basis.coeffs[0].coeffs[1].first;
+    bool has_trivial_kernel() const {
+        static const int points[] = {101, 523};
+        for(int point : points) {
+            if(has_trivial_kernel_at(Mod(point))) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-        Fraction<Univariate> bCoeff = basis.coeffs[0].getCoeff(A.nbCols());
-        basis.coeffs[0].setCoeff(A.nbCols(), 0);
+    /*
+     * Merges all the states of a left kernel `basis` of [A|u] at once. The
+     * basis is brought to reduced form, with one pivot state per vector other
+     * than 0: each pivot then behaves as a combination of non-pivot states
+     * only, so the transitions to all of them can be redirected in one pass.
+     * The pivots are left unreachable, for prune() to drop.
+     */
+    void merge_states(FArithMatrix& basis) {
+        vector<size_t> pivots;
+        vector<MatrixRow<FArithScalar>> vectors;
+        for(auto& vec : basis.coeffs) {
+            for(size_t iVector = 0;iVector < vectors.size();iVector++) {
+                FArithScalar coeff = vec.getCoeff(pivots[iVector]);
+                if(!is_zero(coeff)) {
+                    vec = vec - coeff * vectors[iVector];
+                }
+            }
 
-        for(size_t iRow = 0;iRow < A.nbRows();iRow++) {
-            if(iRow != row) {
-                u.coeffs[iRow].setCoeff(0, u.coeffs[iRow].getCoeff(0) - A.coeffs[iRow].getCoeff(row) / basis.coeffs[0].getCoeff(row) * bCoeff);
+            /* A vector on state 0 alone means it has no output: nothing to merge */
+            size_t pivot = 0;
+            for(auto& coeff : vec.coeffs) {
+                if(coeff.first != 0) {
+                    pivot = coeff.first;
+                    break;
+                }
+            }
+            if(pivot == 0)
+                continue;
+
+            vec *= inverse(vec.getCoeff(pivot));
+            for(auto& other : vectors) {
+                FArithScalar coeff = other.getCoeff(pivot);
+                if(!is_zero(coeff)) {
+                    other = other - coeff * vec;
+                }
+            }
+            pivots.push_back(pivot);
+            vectors.push_back(vec);
+        }
 
-                A.coeffs[iRow] = A.coeffs[iRow] - A.coeffs[iRow].getCoeff(row) / basis.coeffs[0].getCoeff(row) * basis.coeffs[0];
+        vector<bool> is_pivot(A.nbRows(), false);
+        for(size_t pivot : pivots) {
+            is_pivot[pivot] = true;
+        }
+        for(size_t iRow = 0;iRow < A.nbRows();iRow++) {
+            if(is_pivot[iRow])
+                continue;
+            /* Vectors are zero on the other pivots, so these coefficients do not change */
+            for(size_t iVector = 0;iVector < vectors.size();iVector++) {
+                FArithScalar coeff = A.coeffs[iRow].getCoeff(pivots[iVector]);
+                if(!is_zero(coeff)) {
+                    A.coeffs[iRow] = A.coeffs[iRow] - coeff * vectors[iVector];
+                }
             }
         }
+    }
+
+    /*
+     * Drops the useless states, then merges linearly dependent states. Merging
+     * can make other states dependent, hence the loop, but it usually takes a
+     * single kernel. The symbolic kernel is only computed when an evaluation
+     * cannot rule it out.
+     */
+    void simplify() {
+        prune();
+
+        while(!has_trivial_kernel()) {
+            /* [A|u], whose left kernel relates the states with the same future */
+            FArithMatrix augmented(A.nbRows(), A.nbCols() + 1);
+            for(size_t iRow = 0;iRow < A.nbRows();iRow++) {
+                vector<pair<size_t, FArithScalar>> row = A.coeffs[iRow].coeffs;
+                FArithScalar output = u.coeffs[iRow].getCoeff(0);
+                if(!is_zero(output)) {
+                    row.push_back({A.nbCols(), output});
+                }
+                augmented.coeffs[iRow] = MatrixRow<FArithScalar>(row);
+            }
+
+            FArithMatrix basis = kernel_basis(augmented);
+            if(basis.nbRows() == 0) {
+                return;
+            }
 
-        simplify();
+            size_t nb_states = A.nbRows();
+            merge_states(basis);
+            prune();
+            if(A.nbRows() == nb_states) {
+                return;
+            }
+        }
     }
 
     friend std::ostream& operator << (std::ostream& out, const FArith &a) {
@@ -117,9 +284,93 @@ FArith operator * (const FArith &a, const FArith &b) {
     return res;
 }
 
+/*
+ * Product of all `factors` at once, as a product automaton: only the tuples of
+ * states reachable from (0, ..., 0) are built. simplify() then drops those that
+ * cannot reach a nonzero output.
+ */
+FArith product(const vector<FArith>& factors) {
+    assert(!factors.empty());
+    size_t nb_factors = factors.size();
+
+    map<vector<size_t>, size_t> state_ids;
+    vector<vector<size_t>> states;
+    vector<vector<pair<size_t, FArithScalar>>> transitions;
+
+    states.push_back(vector<size_t>(nb_factors, 0));
+    state_ids[states[0]] = 0;
+
+    for(size_t iState = 0;iState < states.size();iState++) {
+        vector<pair<size_t, FArithScalar>> edges;
+
+        /* Enumerate the nonzero entries of the tensor row, one per factor */
+        vector<size_t> cursor(nb_factors, 0);
+        bool has_edges = true;
+        for(size_t iFact = 0;iFact < nb_factors;iFact++) {
+            if (factors[iFact].A.coeffs[states[iState][iFact]].coeffs.empty()) {
+                has_edges = false;
+            }
+        }
+
+        while(has_edges) {
+            vector<size_t> target(nb_factors);
+            FArithScalar coeff = 1;
+            for(size_t iFact = 0;iFact < nb_factors;iFact++) {
+                auto& entry = factors[iFact].A.coeffs[states[iState][iFact]].coeffs[cursor[iFact]];
+                target[iFact] = entry.first;
+                coeff = coeff * entry.second;
+            }
+
+            if (!is_zero(coeff)) {
+                auto it = state_ids.find(target);
+                if (it == state_ids.end()) {
+                    it = state_ids.insert({target, states.size()}).first;
+                    states.push_back(target);
+                }
+                edges.push_back({it->second, coeff});
+            }
+
+            size_t iFact = 0;
+            while(iFact < nb_factors) {
+                cursor[iFact]++;
+                if (cursor[iFact] < factors[iFact].A.coeffs[states[iState][iFact]].coeffs.size()) {
+                    break;
+                }
+                cursor[iFact] = 0;
+                iFact++;
+            }
+            has_edges = (iFact < nb_factors);
+        }
+
+        transitions.push_back(edges);
+    }
+
+    vector<FArithScalar> outputs;
+    for(auto& state : states) {
+        FArithScalar value = 1;
+        for(size_t iFact = 0;iFact < nb_factors && !is_zero(value);iFact++) {
+            value = value * factors[iFact].u.coeffs[state[iFact]].getCoeff(0);
+        }
+        outputs.push_back(value);
+    }
+
+    FArith res = {.A = FArithMatrix(states.size(), states.size()), .u = FArithMatrix(states.size(), 1)};
+    for(size_t iState = 0;iState < states.size();iState++) {
+        sort(transitions[iState].begin(), transitions[iState].end(),
+             [](const pair<size_t, FArithScalar>& a, const pair<size_t, FArithScalar>& b) {
+            return a.first < b.first;
+        });
+        res.A.coeffs[iState] = MatrixRow<FArithScalar>(transitions[iState]);
+        res.u.coeffs[iState].setCoeff(0, outputs[iState]);
+    }
+
+    res.simplify();
+    return res;
+}
+
 FArith operator ^ (const FArith &a, const FArith &b) {
-    FArithMatrix tensAId = tensor(a.A, identity<Fraction<Univariate>>(b.A.nbRows()));
-    FArithMatrix tensIdB = tensor(identity<Fraction<Univariate>>(a.A.nbRows()), b.A);
+    FArithMatrix tensAId = tensor(a.A, identity<FArithScalar>(b.A.nbRows()));
+    FArithMatrix tensIdB = tensor(identity<FArithScalar>(a.A.nbRows()), b.A);
     FArithMatrix cross_mat = tensAId - tensIdB;
 
     FArithMatrix v = tensor(a.u, b.u);
@@ -154,14 +405,14 @@ FArith one() {
     };
 }
 
+/* By squaring, so that each product is simplified before it grows again */
 FArith pow(const FArith &a, size_t exp) {
-    /* Exponentiation by squaring */
-    if (exp <= 0) {
-        return one();
+    if (exp <= 1) {
+        return exp == 0 ? one() : a;
     }
-    FArith res = pow(a, exp/2);
+    FArith res = pow(a, exp / 2);
     res = res * res;
-    if (exp%2 != 0) {
+    if (exp % 2 != 0) {
         res = res * a;
     }
     return res;
@@ -241,7 +492,7 @@ FArith sigma_k(size_t k) {
 FArith sigma_prime_k(size_t k) {
     return {
         .A = FArithMatrix({
-            {z, Fraction<Univariate>(U, U + (U << k)), Fraction<Univariate>(U, U + (U << k)) },
+            {z, FArithScalar(U, U + (U << k)), FArithScalar(U, U + (U << k)) },
             {z, -(U << k), z},
             {z, z, u}
         }),
@@ -287,7 +538,7 @@ FArith simple_factor(size_t k) {
         }),
         .u = FArithMatrix({
             {u},
-            {Fraction<Univariate>(1, k)},
+            {FArithScalar(1, k)},
         })
     };
 }
@@ -327,15 +578,15 @@ FArith psi_k(size_t k) {
     return pow(id(), k) ^ (mobius() * mobius());
 }
 
-FArith precompose_with_kth_power(FArith f, size_t k) {
-    FArithMatrix A = f.A;
-    for(size_t i = 0;i < k - 1;i++) {
-        A = A * f.A;
-    }
-    return {
-        .A = A,
+/* n -> f(n^k) */
+FArith precompose_with_kth_power(const FArith& f, size_t k) {
+    assert(k > 0);
+    FArith res = {
+        .A = pow(f.A, k),
         .u = f.u
     };
+    res.simplify();
+    return res;
 }
 
 /********************************************************
@@ -0,0 +1,294 @@
+/*
+ * Microbenchmarks of each arithmetic layer, from Mod up to the relation
+ * kernel. Inputs are drawn from generators with fixed seeds, or built from
+ * fixed formulas, so that two commits run the same computations.
+ * Output is CSV: `benchmark,size,ops,ns_per_op`, or JSON with --json.
+ * The optional argument after it is a substring of the benchmarks to run.
+ */
+constexpr int PRIME_MODULO = 997;
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include "../arith_f.h"
+#include "../relations.h"
+using namespace std;
+
+/* Each benchmark repeats its operation for at least this long */
+static const double MIN_SECONDS = 0.2;
+
+/* Results are folded into this, so that the work is not optimized away */
+static volatile size_t sink;
+
+struct BenchResult {
+    string name;
+    size_t size;
+    size_t nb_ops;
+    double ns_per_op;
+};
+
+static vector<BenchResult> results;
+static const char* filter = NULL;
+
+static bool selected(const string& name) {
+    return filter == NULL || name.find(filter) != string::npos;
+}
+
+/* `op` runs `nb_ops` operations, and is run in doubling batches until MIN_SECONDS */
+template<typename F>
+static void measure(const string& name, size_t size, size_t nb_ops, F op) {
+    op(); /* Warm-up */
+    size_t iterations = 0;
+    size_t batch = 1;
+    std::chrono::duration<double> elapsed(0);
+    auto t1 = std::chrono::steady_clock::now();
+    while (elapsed.count() < MIN_SECONDS) {
+        for (size_t i = 0; i < batch; i++) {
+            op();
+        }
+        iterations += batch;
+        batch *= 2;
+        elapsed = std::chrono::steady_clock::now() - t1;
+    }
+    results.push_back({name, size, iterations * nb_ops, elapsed.count() * 1e9 / (iterations * nb_ops)});
+    cerr << name << " " << size << ": " << results.back().ns_per_op << " ns" << endl;
+}
+
+static Univariate randomPolynomial(mt19937& rng, size_t degree) {
+    uniform_int_distribution<int> coeff(0, modulo - 1);
+    vector<Mod> coeffs;
+    for (size_t i = 0; i < degree; i++) {
+        coeffs.push_back(Mod(coeff(rng)));
+    }
+    coeffs.push_back(Mod(1 + coeff(rng) % (modulo - 1)));
+    return Univariate(coeffs);
+}
+
+static void benchMod() {
+    if (!selected("mod_mul")) {
+        return;
+    }
+    mt19937 rng(1);
+    uniform_int_distribution<int> coeff(1, modulo - 1);
+    vector<Mod> values;
+    for (size_t i = 0; i < 1024; i++) {
+        values.push_back(Mod(coeff(rng)));
+    }
+    measure("mod_mul", values.size(), values.size(), [&]() {
+        Mod acc(1);
+        for (const Mod& value : values) {
+            acc *= value;
+        }
+        sink = sink + acc.value;
+    });
+}
+
+static void benchPolynomial() {
+    static const size_t degrees[] = {8, 32, 128, 512};
+    for (size_t degree : degrees) {
+        mt19937 rng(2);
+        Univariate a = randomPolynomial(rng, degree);
+        Univariate b = randomPolynomial(rng, degree);
+        Univariate c = randomPolynomial(rng, degree / 2);
+        Univariate ab = a * b;
+        Univariate ac = a * c;
+        Univariate bc = b * c;
+
+        if (selected("poly_mul")) {
+            measure("poly_mul", degree, 1, [&]() {
+                sink = sink + (a * b).size();
+            });
+        }
+        if (selected("poly_div")) {
+            measure("poly_div", degree, 1, [&]() {
+                sink = sink + (ab / b).size();
+            });
+        }
+        if (selected("poly_gcd")) {
+            /* A common factor of half the degree */
+            measure("poly_gcd", degree, 1, [&]() {
+                sink = sink + gcd(ac, bc).size();
+            });
+        }
+    }
+}
+
+static void benchFraction() {
+    if (!selected("fraction_add")) {
+        return;
+    }
+    static const size_t degrees[] = {4, 16, 64};
+    for (size_t degree : degrees) {
+        mt19937 rng(3);
+        Univariate common = randomPolynomial(rng, degree / 2);
+        /* Denominators sharing a factor, as those of the generated fractions do */
+        Fraction<Univariate> a(randomPolynomial(rng, degree), common * randomPolynomial(rng, degree / 2));
+        Fraction<Univariate> b(randomPolynomial(rng, degree), common * randomPolynomial(rng, degree / 2));
+        measure("fraction_add", degree, 1, [&]() {
+            sink = sink + (a + b).getNumerator().size();
+        });
+    }
+}
+
+/* Leaves of the default generation, from a few states to a few dozen once multiplied */
+static vector<FArith> sampleFormulas() {
+    return {sigma_k(1), tau(2), jordan_totient(2), xi_k(2), liouville(), nu_k(2), theta(), sigma_prime_k(1)};
+}
+
+/* What each leaf adds to the smallest s that add_relations() uses: below it, id - A is singular */
+static const size_t SAMPLE_WEIGHTS[] = {1, 2, 2, 2, 0, 1, 0, 1};
+
+static void benchFArith() {
+    vector<FArith> formulas = sampleFormulas();
+    if (selected("farith_mul")) {
+        for (size_t iFormula = 0; iFormula + 1 < formulas.size(); iFormula += 2) {
+            const FArith& a = formulas[iFormula];
+            const FArith& b = formulas[iFormula + 1];
+            measure("farith_mul", a.A.nbRows() * b.A.nbRows(), 1, [&]() {
+                sink = sink + (a * b).A.nbRows();
+            });
+        }
+    }
+
+    /* Operands as arith_f.h combines them: others can make the cross matrix singular */
+    if (selected("farith_tensor")) {
+        vector<pair<FArith, FArith>> operands = {
+            {one(), pow(id(), 2)},
+            {pow(id(), 2), mobius()},
+            {pow(id(), 2), nu_k(3)},
+            {pow(id(), 3), mobius() * mobius()},
+        };
+        for (auto& operand : operands) {
+            const FArith& a = operand.first;
+            const FArith& b = operand.second;
+            measure("farith_tensor", a.A.nbRows() * b.A.nbRows(), 1, [&]() {
+                sink = sink + (a ^ b).A.nbRows();
+            });
+        }
+    }
+}
+
+/* The automaton of `leaves` times 1/ζ^s, built in the same order as add_relations() builds it */
+static FArith generatedFormula(const vector<FArith>& leaves, size_t s) {
+    vector<FArith> factors = leaves;
+    factors.insert(factors.begin(), one());
+    FArith formula = product(factors);
+    factors.assign(s, inv_id());
+    factors.insert(factors.begin(), formula);
+    return product(factors);
+}
+
+static void benchInverse() {
+    if (!selected("matrix_inverse")) {
+        return;
+    }
+    vector<FArith> formulas = sampleFormulas();
+    /* Up to σ^2 σ'^2, the largest automaton of the default generation (16 states) */
+    static const vector<vector<size_t>> leaf_sets = {{0}, {0, 1}, {0, 0, 7}, {0, 0, 7, 7}};
+    for (auto& leaf_set : leaf_sets) {
+        vector<FArith> leaves;
+        size_t weight = 0;
+        for (size_t iFormula : leaf_set) {
+            leaves.push_back(formulas[iFormula]);
+            weight += SAMPLE_WEIGHTS[iFormula];
+        }
+        FArith formula = generatedFormula(leaves, 2 + weight);
+        FArithMatrix id_minus_a = identity<FArithScalar>(formula.A.nbRows()) - formula.A;
+        measure("matrix_inverse", id_minus_a.nbRows(), 1, [&]() {
+            sink = sink + inverse(id_minus_a).nbRows();
+        });
+    }
+}
+
+/* Fractions of products of two sample formulas, as a smaller add_relations() would make */
+static vector<Fraction<Univariate>> sampleFractions() {
+    vector<FArith> formulas = sampleFormulas();
+    vector<Fraction<Univariate>> fractions;
+    for (size_t iFormula = 0; iFormula < formulas.size(); iFormula++) {
+        for (size_t jFormula = iFormula; jFormula < formulas.size(); jFormula++) {
+            size_t min_s = 2 + SAMPLE_WEIGHTS[iFormula] + SAMPLE_WEIGHTS[jFormula];
+            for (size_t s = min_s; s <= min_s + 2; s++) {
+                FArithScalar frac = generatedFormula({formulas[iFormula], formulas[jFormula]}, s).get_fraction();
+                fractions.push_back(Fraction<Univariate>(frac.getNumerator(), frac.getDenominator(), false));
+            }
+        }
+    }
+    return fractions;
+}
+
+static void benchRelations() {
+    if (!selected("prepare_basis") && !selected("kernel_basis")) {
+        return;
+    }
+    vector<Fraction<Univariate>> fractions = sampleFractions();
+    RelationGenerator manager(NULL);
+    for (auto& frac : fractions) {
+        manager.polynomials.push_back(frac.getNumerator());
+        manager.polynomials.push_back(frac.getDenominator());
+    }
+    if (selected("prepare_basis")) {
+        measure("prepare_basis", manager.polynomials.size(), 1, [&]() {
+            manager.prepareBasis();
+            sink = sink + manager.polynomial_basis.size();
+        });
+    } else {
+        manager.prepareBasis();
+    }
+
+    if (selected("kernel_basis")) {
+        Matrix<Rational> decompositions(0, 0);
+        for (auto& frac : fractions) {
+            MatrixRow<Rational> row = decompose(frac.getNumerator(), manager.polynomial_basis, manager.basis_trial_order);
+            row = row - MatrixRow<Rational>(decompose(frac.getDenominator(), manager.polynomial_basis, manager.basis_trial_order));
+            decompositions.coeffs.push_back(row);
+        }
+        decompositions.actualizeNCols();
+        decompositions = prepare_matrix(decompositions);
+        measure("kernel_basis", decompositions.nbRows(), 1, [&]() {
+            sink = sink + kernel_basis(decompositions).nbRows();
+        });
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    for (int iArg = 1; iArg < argc; iArg++) {
+        if (strcmp(argv[iArg], "--json") == 0) {
+            json = true;
+        } else {
+            filter = argv[iArg];
+        }
+    }
+
+    precomputeInverses();
+    X.setCoeff(1, 1);
+    U.setCoeff(0, 1);
+    x = FArithScalar(X);
+    u = FArithScalar(U);
+    z = FArithScalar(Z);
+
+    benchMod();
+    benchPolynomial();
+    benchFraction();
+    benchFArith();
+    benchInverse();
+    benchRelations();
+
+    if (json) {
+        cout << "{\"benchmarks\": [";
+        for (size_t iResult = 0; iResult < results.size(); iResult++) {
+            const BenchResult& result = results[iResult];
+            cout << (iResult ? ",\n  " : "\n  ")
+                 << "{\"name\": \"" << result.name << "\", \"size\": " << result.size
+                 << ", \"ops\": " << result.nb_ops << ", \"ns_per_op\": " << result.ns_per_op << "}";
+        }
+        cout << "\n]}" << endl;
+    } else {
+        cout << "benchmark,size,ops,ns_per_op" << endl;
+        for (const BenchResult& result : results) {
+            cout << result.name << "," << result.size << "," << result.nb_ops << "," << result.ns_per_op << endl;
+        }
+    }
+    return 0;
+}
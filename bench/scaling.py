@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""
+Runs the whole pipeline over a grid of generation constraints, to see how
+each phase scales with the number of fractions.
+
+Usage: bench/scaling.py [--sums 2,4,6,8] [--scores 4,6] [--leaves LEAVES]...
+                        [--threads N] [--repeat N] [--json]
+
+Each --leaves is a comma-separated list for GEN_LEAVES (see generation.h),
+or "all" for the lines of main.cpp; several of them are swept in turn.
+The other variables read by crazysums are cleared, so that every run
+does the whole work the same way; --threads sets NB_THREADS.
+
+Output is CSV, one line per run, with the peak RSS from wait4() and the
+phase times from METRICS_JSON. The child starts as a copy of this
+script, so a peak RSS below that of the script (about 13 MB) reads as
+the script's. A summary on stderr gives, per phase, the exponent of its
+time against the number of fractions between the two largest runs:
+above 1, the phase grows faster than the input.
+"""
+import argparse
+import csv
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+BIN = os.path.join(os.getcwd(), "crazysums")
+
+COUNTS = {
+   "fractions": re.compile(r"Data generated \((\d+) fractions\)"),
+   "basis": re.compile(r"Basis prepared \((\d+) polynomials\)"),
+   "relations": re.compile(r"Classified (\d+) relations"),
+}
+ANSI = re.compile(r"\x1b\[[0-9;]*m")
+
+# Variables that would skip work (caches, checkpoints), change the
+# algorithm or the thread count, or write files of their own
+CLEARED_VARIABLES = [
+   "CHECKPOINT_LOAD", "CHECKPOINT_SAVE", "CLASSIFY_STATS", "CLASSIFY_STATS_JSON",
+   "EXTEND_MAX_SCORE", "EXTEND_MAX_SUM", "FRACTION_CACHE", "FRACTION_LAZY_THRESHOLD",
+   "GEN_LEAVES", "METRICS_CSV", "NB_THREADS", "PIPELINE",
+]
+
+def int_list(text):
+   return [int(value) for value in text.split(",")]
+
+def run(max_sum, max_score, leaves, threads, work):
+   env = dict(os.environ)
+   for name in CLEARED_VARIABLES:
+      env.pop(name, None)
+   env["GEN_MAX_SUM"] = str(max_sum)
+   env["GEN_MAX_SCORE"] = str(max_score)
+   if threads is not None:
+      env["NB_THREADS"] = str(threads)
+   if leaves != "all":
+      env["GEN_LEAVES"] = leaves
+   metrics_path = os.path.join(work, "metrics.json")
+   env["METRICS_JSON"] = metrics_path
+
+   # Waited for with wait4() rather than by Popen, to get the peak RSS of the child alone
+   start = time.monotonic()
+   proc = subprocess.Popen([BIN], cwd=work, env=env,
+                           stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+   err = ANSI.sub("", proc.stderr.read().decode(errors="replace"))
+   proc.stderr.close()
+   _, status, usage = os.wait4(proc.pid, 0)
+   wall = time.monotonic() - start
+   proc.returncode = os.waitstatus_to_exitcode(status)
+   if proc.returncode != 0:
+      sys.exit("crazysums failed for max_sum=%d max_score=%d leaves=%s:\n%s"
+               % (max_sum, max_score, leaves, err))
+
+   row = {
+      "max_sum": max_sum,
+      "max_score": max_score,
+      "leaves": leaves,
+      "wall_s": wall,
+      "cpu_s": usage.ru_utime + usage.ru_stime,
+      "peak_rss_kb": usage.ru_maxrss,
+   }
+   for name, pattern in COUNTS.items():
+      match = pattern.search(err)
+      row[name] = int(match.group(1)) if match else 0
+   with open(metrics_path) as metrics:
+      for metric in json.load(metrics)["metrics"]:
+         row[metric["name"] + "_s"] = metric["total_s"]
+   return row
+
+def best_of(rows):
+   """The fastest of repeated runs, whose times are the least disturbed"""
+   return min(rows, key=lambda row: row["wall_s"])
+
+def print_exponents(rows):
+   for leaves in sorted(set(row["leaves"] for row in rows)):
+      runs = sorted((row for row in rows if row["leaves"] == leaves), key=lambda row: row["fractions"])
+      if len(runs) < 2 or runs[-2]["fractions"] == runs[-1]["fractions"]:
+         continue
+      small, large = runs[-2], runs[-1]
+      ratio = math.log(large["fractions"] / small["fractions"])
+      print("leaves=%s, %d -> %d fractions:" % (leaves, small["fractions"], large["fractions"]), file=sys.stderr)
+      for key in small:
+         # Phases under a millisecond are mostly noise
+         if key.endswith("_s") and small[key] > 1e-3 and large[key] > 1e-3:
+            exponent = math.log(large[key] / small[key]) / ratio
+            print("   %-20s n^%.2f" % (key[:-2], exponent), file=sys.stderr)
+
+def main():
+   parser = argparse.ArgumentParser(description="Scaling of the pipeline phases")
+   parser.add_argument("--sums", type=int_list, default=[2, 4, 6, 8])
+   parser.add_argument("--scores", type=int_list, default=[4, 6])
+   parser.add_argument("--leaves", action="append")
+   parser.add_argument("--threads", type=int)
+   parser.add_argument("--repeat", type=int, default=1)
+   parser.add_argument("--json", action="store_true")
+   args = parser.parse_args()
+
+   if not os.access(BIN, os.X_OK):
+      sys.exit("Build ./crazysums first (make build)")
+
+   rows = []
+   with tempfile.TemporaryDirectory() as work:
+      for leaves in args.leaves or ["all"]:
+         for max_score in args.scores:
+            for max_sum in args.sums:
+               rows.append(best_of([run(max_sum, max_score, leaves, args.threads, work) for _ in range(args.repeat)]))
+               print("max_sum=%d max_score=%d leaves=%s: %.2fs"
+                     % (max_sum, max_score, leaves, rows[-1]["wall_s"]), file=sys.stderr)
+
+   if args.json:
+      json.dump(rows, sys.stdout, indent=1)
+      print()
+   else:
+      writer = csv.DictWriter(sys.stdout, fieldnames=list(rows[0].keys()), lineterminator="\n")
+      writer.writeheader()
+      writer.writerows(rows)
+   print_exponents(rows)
+
+if __name__ == "__main__":
+   main()
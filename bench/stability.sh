@@ -0,0 +1,37 @@
+#!/bin/sh
+# Checks that the output does not depend on the number of threads.
+# Usage: bench/stability.sh [thread counts...]   (default: 1 2 4 8)
+# Runs ./crazysums once per count and diffs the outputs without timings.
+set -eu
+
+BIN=$(pwd)/crazysums
+[ -x "$BIN" ] || { echo "Build ./crazysums first (make build)" >&2; exit 2; }
+[ $# -gt 0 ] || set -- 1 2 4 8
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+reference=
+status=0
+echo "threads,seconds,identical"
+for nb_threads in "$@"; do
+    mkdir -p "$WORK/$nb_threads"
+    start=$(date +%s.%N)
+    (cd "$WORK/$nb_threads" && NB_THREADS=$nb_threads "$BIN" >out.txt 2>err.txt)
+    end=$(date +%s.%N)
+    sed -E 's/\([0-9.e-]+s\)//g' "$WORK/$nb_threads/out.txt" > "$WORK/$nb_threads/norm.txt"
+
+    identical=yes
+    if [ -z "$reference" ]; then
+        reference=$nb_threads
+    elif ! cmp -s "$WORK/$reference/norm.txt" "$WORK/$nb_threads/norm.txt"; then
+        identical=no
+        status=1
+    fi
+    echo "$nb_threads,$(awk "BEGIN { print $end - $start }"),$identical"
+done
+
+if [ $status -ne 0 ]; then
+    echo "Output differs from the run with $reference thread(s)" >&2
+fi
+exit $status
@@ -0,0 +1,64 @@
+/*
+ * Startup cost of the modular inverse table, for several modulus sizes.
+ * Output is CSV: `modulus,method,seconds`.
+ */
+constexpr int PRIME_MODULO = 997;
+
+#include <chrono>
+#include <iostream>
+#include "../bigint.h"
+using namespace std;
+
+/* The historical O(p^2) search, kept as a reference */
+static vector<int> quadraticInverseTable(int p) {
+    vector<int> inv(p, 0);
+    for(int i = 1;i < p;i++) {
+        int j = 1;
+        for(;((int64_t)i * j) % p != 1;j++);
+        inv[i] = j;
+    }
+    return inv;
+}
+
+static vector<int> euclidInverseTable(int p) {
+    vector<int> inv(p, 0);
+    for(int i = 1;i < p;i++) {
+        inv[i] = euclidInverse(i, p);
+    }
+    return inv;
+}
+
+template<typename F>
+static void measure(int p, const char* method, F builder, const vector<int>& reference) {
+    auto t1 = std::chrono::high_resolution_clock::now();
+    vector<int> inv = builder(p);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> e21 = t2 - t1;
+
+    if (!reference.empty() && inv != reference) {
+        cerr << "Mismatch for " << method << " at p=" << p << endl;
+        exit(1);
+    }
+    cout << p << "," << method << "," << e21.count() << endl;
+}
+
+int main() {
+    static const int primes[] = {997, 10007, 100003, 1000003, 10000019};
+    /* Beyond this, the quadratic search takes minutes */
+    static const int quadratic_max = 10007;
+
+    cout << "modulus,method,seconds" << endl;
+    for(int p : primes) {
+        vector<int> reference = linearInverseTable(p);
+        for(int i = 1;i < p;i++) {
+            assert(((int64_t)i * reference[i]) % p == 1);
+        }
+
+        measure(p, "linear", linearInverseTable, reference);
+        measure(p, "euclid", euclidInverseTable, reference);
+        if (p <= quadratic_max) {
+            measure(p, "quadratic", quadraticInverseTable, reference);
+        }
+    }
+    return 0;
+}
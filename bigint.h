@@ -1,4 +1,6 @@
 #pragma once
+#include <cassert>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -95,6 +97,10 @@ public:
     int to_int() {
         return n;
     }
+
+    int64_t to_int64() const {
+        return n;
+    }
 };
 
 #if 0
@@ -121,6 +127,10 @@ bool normalFactorCanReduce(const SomeInt& a) {
   return a != SomeInt(1);
 }
 
+size_t normalDegree([[maybe_unused]] const SomeInt& a) {
+  return 0;
+}
+
 std::string toString(const SomeInt& a) {
   return a.str();
 }
@@ -133,7 +143,8 @@ public: /* TODO: Refactor inverse someday */
 
 public:
     Mod(int _constant) {
-        value = ((_constant % modulo) + modulo) % modulo;
+        /* 64-bit throughout: moduli above 2^30 would overflow an int */
+        value = (int)((((int64_t)_constant % modulo) + modulo) % modulo);
     }
 
     bool operator == (const Mod& m) const {
@@ -149,23 +160,24 @@ public:
     }
 
     void operator += (const Mod& m) {
-        int v = value + m.value;
+        int64_t v = (int64_t)value + m.value;
         if (v >= modulo) {
             v -= modulo;
         }
-        value = v;
+        value = (int)v;
     }
 
     void operator -= (const Mod& m) {
-        int v = modulo + value - m.value;
+        int64_t v = (int64_t)modulo + value - m.value;
         if (v >= modulo) {
             v -= modulo;
         }
-        value = v;
+        value = (int)v;
     }
 
     void operator *= (const Mod& m) {
-        value = (value * m.value) % modulo;
+        /* 64-bit product: moduli above 2^15 would overflow an int */
+        value = (int)(((int64_t)value * m.value) % modulo);
     }
 
     friend std::string toString(const Mod& a) {
@@ -180,18 +192,73 @@ public:
     }
 };
 
+/*
+ * Above this modulus the table would not fit comfortably in memory (and would
+ * take longer to build than the inverses we actually need), so `inverse()`
+ * computes them on demand instead.
+ */
+constexpr int INVERSE_TABLE_MAX_MODULO = 1 << 24;
+
 std::vector<Mod> inverseTable;
 
+/*
+ * Linear-time inverse table for a prime p:
+ *   p = (p / i) * i + (p % i)  =>  inv[i] = -(p / i) * inv[p % i]  (mod p)
+ */
+inline int linearInverseStep(int p, int i, int inv_rest) {
+    return (int)(p - ((int64_t)(p / i) * inv_rest) % p);
+}
+
+std::vector<int> linearInverseTable(int p) {
+    std::vector<int> inv(p, 0);
+    if (p > 1) {
+        inv[1] = 1;
+    }
+    for(int i = 2;i < p;i++) {
+        inv[i] = linearInverseStep(p, i, inv[p % i]);
+    }
+    return inv;
+}
+
+/* Extended Euclid, for moduli too large for the table. Like the table, maps 0 to 0. */
+int euclidInverse(int a, int p) {
+    if (a == 0) {
+        return 0;
+    }
+    int64_t r0 = p, r1 = a;
+    int64_t t0 = 0, t1 = 1;
+    while(r1 != 0) {
+        int64_t q = r0 / r1;
+        int64_t r2 = r0 - q * r1;
+        r0 = r1;
+        r1 = r2;
+        int64_t t2 = t0 - q * t1;
+        t0 = t1;
+        t1 = t2;
+    }
+    assert(r0 == 1); /* `a` must be invertible */
+    return (int)(((t0 % p) + p) % p);
+}
+
 void precomputeInverses() {
-    inverseTable.push_back(Mod(0));
-    for(int i = 1;i < modulo;i++) {
-        int j = 1;
-        for(;(i * j) % modulo != 1;j++);
-        inverseTable.push_back(Mod(j));
+    inverseTable.clear();
+    if (modulo > INVERSE_TABLE_MAX_MODULO) {
+        return;
+    }
+    /* Filled in place rather than from linearInverseTable(), which would double the peak memory */
+    inverseTable.assign(modulo, Mod(0));
+    if (modulo > 1) {
+        inverseTable[1] = Mod(1);
+    }
+    for(int i = 2;i < modulo;i++) {
+        inverseTable[i].value = linearInverseStep(modulo, i, inverseTable[modulo % i].value);
     }
 }
 
 Mod inverse(const Mod& a) {
+    if (inverseTable.empty()) {
+        return Mod(euclidInverse(a.value, modulo));
+    }
     return inverseTable[a.value];
 }
 
@@ -221,3 +288,7 @@ Mod operator * (const Mod& a, const Mod& b) {
 Mod operator / (const Mod&a, const Mod& b) {
     return a * inverse(b);
 }
+
+bool is_zero(const Mod& a) {
+    return a.value == 0;
+}
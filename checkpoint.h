@@ -0,0 +1,259 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "hformula.h"
+#include "matrix.h"
+#include "polynomial.h"
+using namespace std;
+
+/*
+ * Binary checkpoint of a run, so that a later run can resume after any
+ * stage. The file is a header followed by a payload of native 32-bit words,
+ * so it can be mapped and read in place:
+ *
+ *   names          count, then each HFormula as written by Node::serialize()
+ *   fractions      count, then numerator, denominator and whether reduced, of each
+ *   basis          count, the polynomials, then their trial order    (stage >= BASIS)
+ *   decompositions rows, cols, then per row its entries              (stage >= DECOMPOSITIONS)
+ *
+ * A polynomial is its number of coefficients then the coefficients; a matrix
+ * entry is its column then the numerator and denominator, as 64-bit values.
+ */
+enum CheckpointStage : uint32_t {
+   CHECKPOINT_NONE,
+   CHECKPOINT_FRACTIONS,
+   CHECKPOINT_BASIS,
+   CHECKPOINT_DECOMPOSITIONS,
+};
+
+constexpr char CHECKPOINT_MAGIC[8] = {'C', 'R', 'Z', 'S', 'U', 'M', 'S', '\0'};
+constexpr uint32_t CHECKPOINT_VERSION = 3;
+
+struct CheckpointHeader {
+   char magic[8];
+   uint32_t version;
+   uint32_t modulo; /* Coefficients are only meaningful for the same prime */
+   uint32_t stage;
+   uint32_t reserved;
+   uint64_t configuration; /* What the fractions were generated with, see checkpoint_configuration() */
+   uint64_t nb_words;
+   uint64_t checksum; /* FNV-1a of the payload */
+};
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+   const unsigned char* bytes = (const unsigned char*)data;
+   for(size_t i = 0;i < size;i++) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+class CheckpointWriter {
+public:
+   void putWord(uint32_t word) {
+      words.push_back(word);
+   }
+   void putInt64(int64_t value) {
+      putWord((uint32_t)((uint64_t)value & 0xFFFFFFFF));
+      putWord((uint32_t)((uint64_t)value >> 32));
+   }
+   void putFormula(const HFormula& formula) {
+      formula.get()->serialize(words);
+   }
+   void putPolynomial(const Univariate& poly) {
+      putWord(poly.size());
+      for(size_t iCoeff = 0;iCoeff < poly.size();iCoeff++) {
+         putWord(poly.getCoeff(iCoeff).value);
+      }
+   }
+   void putRow(const MatrixRow<Rational>& row) {
+      putWord(row.coeffs.size());
+      for(auto& entry : row.coeffs) {
+         putWord(entry.first);
+         putInt64(entry.second.getNumerator().to_int64());
+         putInt64(entry.second.getDenominator().to_int64());
+      }
+   }
+
+   /* Writes to a temporary file first, so that an interrupted save keeps the previous checkpoint */
+   bool save(const string& path, CheckpointStage stage, uint64_t configuration) const;
+private:
+   vector<uint32_t> words;
+};
+
+bool CheckpointWriter::save(const string& path, CheckpointStage stage, uint64_t configuration) const {
+   CheckpointHeader header;
+   memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+   header.version = CHECKPOINT_VERSION;
+   header.modulo = modulo;
+   header.stage = stage;
+   header.reserved = 0;
+   header.configuration = configuration;
+   header.nb_words = words.size();
+   header.checksum = fnv1a(words.data(), words.size() * sizeof(uint32_t));
+
+   string tmp_path = path + ".tmp";
+   FILE* file = fopen(tmp_path.c_str(), "wb");
+   if(file == NULL) {
+      return false;
+   }
+   bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(words.data(), sizeof(uint32_t), words.size(), file) == words.size();
+   ok = (fclose(file) == 0) && ok;
+   return ok && rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+/*
+ * Maps a checkpoint and reads it in place. A read past the end of the payload,
+ * or of a value CheckpointWriter cannot have written, sets error() and returns
+ * zeros from then on, so that callers only check error() after a section.
+ */
+class CheckpointReader {
+public:
+   /* `configuration` is compared with the one the checkpoint was saved with */
+   CheckpointReader(const string& path, uint64_t configuration);
+   ~CheckpointReader();
+   CheckpointReader(const CheckpointReader&) = delete;
+   CheckpointReader& operator=(const CheckpointReader&) = delete;
+
+   /* Empty when the file is usable */
+   const string& error() const {
+      return error_message;
+   }
+   CheckpointStage stage() const {
+      return (CheckpointStage)header->stage;
+   }
+   size_t remaining() const {
+      return end - cursor;
+   }
+   void fail(const string& message) {
+      if(error_message.empty()) {
+         error_message = message;
+      }
+      cursor = end;
+   }
+
+   uint32_t getWord() {
+      if(cursor == end) {
+         fail("truncated payload");
+         return 0;
+      }
+      return *cursor++;
+   }
+   /* A number of items taking at least `item_words` words each, so at most what is left */
+   size_t getCount(size_t item_words = 1) {
+      size_t count = getWord();
+      if(count > remaining() / item_words) {
+         fail("count past the end of the payload");
+         return 0;
+      }
+      return count;
+   }
+   int64_t getInt64() {
+      uint64_t low = getWord();
+      uint64_t high = getWord();
+      return (int64_t)(low | (high << 32));
+   }
+   HFormula getFormula() {
+      bool valid = true;
+      HFormula formula = HFormulaSerialized(cursor, end, valid);
+      if(!valid) {
+         fail("bad formula");
+      }
+      return formula;
+   }
+   Univariate getPolynomial() {
+      vector<Mod> coeffs;
+      size_t size = getCount();
+      coeffs.reserve(size);
+      for(size_t iCoeff = 0;iCoeff < size;iCoeff++) {
+         uint32_t value = getWord();
+         if(value >= (uint32_t)modulo) {
+            fail("coefficient out of range");
+         }
+         coeffs.push_back(Mod((int)value));
+      }
+      /* Written reduced: no leading zero, and so never the zero polynomial */
+      if(coeffs.empty() || coeffs.back() == Mod(0)) {
+         fail("polynomial not reduced");
+      }
+      return Univariate(move(coeffs));
+   }
+   MatrixRow<Rational> getRow(size_t nb_cols) {
+      vector<pair<size_t, Rational>> entries;
+      size_t size = getCount(5);
+      entries.reserve(size);
+      for(size_t iEntry = 0;iEntry < size;iEntry++) {
+         size_t col = getWord();
+         int64_t numerator = getInt64();
+         int64_t denominator = getInt64();
+         /* Written sorted by column, without zeros, in lowest terms */
+         bool sorted = entries.empty() || col > entries.back().first;
+         SomeInt common = (numerator == 0 || denominator <= 0) ? SomeInt(0) : gcd(SomeInt(numerator), SomeInt(denominator));
+         if(col >= nb_cols || !sorted || (common != SomeInt(1) && common != SomeInt(-1))) {
+            fail("bad matrix entry");
+            break;
+         }
+         entries.push_back({col, Rational::fromReduced(SomeInt(numerator), SomeInt(denominator))});
+      }
+      return MatrixRow<Rational>(entries);
+   }
+private:
+   void* mapping = MAP_FAILED;
+   size_t mapping_size = 0;
+   const CheckpointHeader* header = NULL;
+   const uint32_t* cursor = NULL;
+   const uint32_t* end = NULL;
+   string error_message;
+};
+
+CheckpointReader::CheckpointReader(const string& path, uint64_t configuration) {
+   int fd = open(path.c_str(), O_RDONLY);
+   if(fd < 0) {
+      error_message = "cannot open file";
+      return;
+   }
+   struct stat file_stat;
+   if(fstat(fd, &file_stat) == 0 && (size_t)file_stat.st_size >= sizeof(CheckpointHeader)) {
+      mapping_size = file_stat.st_size;
+      mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   }
+   close(fd);
+   if(mapping == MAP_FAILED) {
+      error_message = "cannot map file";
+      return;
+   }
+
+   header = (const CheckpointHeader*)mapping;
+   cursor = (const uint32_t*)(header + 1);
+   end = cursor + (mapping_size - sizeof(CheckpointHeader)) / sizeof(uint32_t);
+   if(memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0) {
+      error_message = "not a checkpoint";
+   } else if(header->version != CHECKPOINT_VERSION) {
+      error_message = "version " + to_string(header->version) + ", expected " + to_string(CHECKPOINT_VERSION);
+   } else if(header->modulo != (uint32_t)modulo) {
+      error_message = "modulo " + to_string(header->modulo) + ", expected " + to_string(modulo);
+   } else if(header->configuration != configuration) {
+      error_message = "saved with other generation constraints or modes";
+   } else if(header->nb_words != (uint64_t)(end - cursor)) {
+      error_message = "truncated";
+   } else if(header->checksum != fnv1a(cursor, header->nb_words * sizeof(uint32_t))) {
+      error_message = "bad checksum";
+   } else if(header->stage == CHECKPOINT_NONE || header->stage > CHECKPOINT_DECOMPOSITIONS) {
+      error_message = "unknown stage";
+   }
+}
+
+CheckpointReader::~CheckpointReader() {
+   if(mapping != MAP_FAILED) {
+      munmap(mapping, mapping_size);
+   }
+}
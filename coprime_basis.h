@@ -0,0 +1,171 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <vector>
+#include "polynomial.h"
+using namespace std;
+
+/*
+ * A set of pairwise coprime monic polynomials, refined one polynomial at a
+ * time. When a new polynomial shares a proper factor with an element, that
+ * element is split: it dies, and its expansion over the new elements is kept,
+ * so factorizations returned earlier stay valid and can be resolved later.
+ * Split elements are also logged, for callers that keep data per element.
+ * Elements are never moved, so references to them stay valid as it grows.
+ */
+class CoprimeBasis {
+public:
+   typedef vector<pair<size_t, int>> Factorization; /* (element id, exponent), sorted by id */
+
+   /* Refines the basis so that `poly` is a product of elements, up to a constant */
+   Factorization add(Univariate poly);
+   /* Same factorization, over the elements that are alive now */
+   Factorization resolve(const Factorization& factorization) const;
+   /* Expansion of a dead element over the elements alive now */
+   Factorization expand(size_t id) const;
+   /* Elements split since the last call, in the order they were split */
+   vector<size_t> takeSplitElements();
+
+   vector<size_t> aliveElements() const;
+   bool isAlive(size_t id) const;
+   const Univariate& element(size_t id) const;
+   size_t nbSplits() const;
+private:
+   Factorization add(Univariate poly, size_t start);
+   void split(size_t id, const Univariate& divisor);
+
+   deque<Univariate> elements;
+   vector<bool> alive;
+   vector<Factorization> expansions; /* Empty while alive */
+   size_t nb_splits = 0;
+   vector<size_t> split_log;
+};
+
+/* Sums two factorizations, dropping zero exponents */
+CoprimeBasis::Factorization combine(const CoprimeBasis::Factorization& a, int mult_a,
+                                    const CoprimeBasis::Factorization& b, int mult_b) {
+   CoprimeBasis::Factorization result;
+   size_t c_a = 0;
+   size_t c_b = 0;
+   while (c_a < a.size() || c_b < b.size()) {
+      size_t id;
+      int exponent;
+      if (c_b == b.size() || (c_a < a.size() && a[c_a].first < b[c_b].first)) {
+         id = a[c_a].first;
+         exponent = mult_a * a[c_a++].second;
+      } else if (c_a == a.size() || b[c_b].first < a[c_a].first) {
+         id = b[c_b].first;
+         exponent = mult_b * b[c_b++].second;
+      } else {
+         id = a[c_a].first;
+         exponent = mult_a * a[c_a++].second + mult_b * b[c_b++].second;
+      }
+      if (exponent != 0) {
+         result.push_back({id, exponent});
+      }
+   }
+   return result;
+}
+
+CoprimeBasis::Factorization CoprimeBasis::add(Univariate poly) {
+   return add(poly, 0);
+}
+
+/* Only the elements from `start` on can share a factor with `poly` */
+CoprimeBasis::Factorization CoprimeBasis::add(Univariate poly, size_t start) {
+   Factorization result;
+   for(size_t id = start;id < elements.size() && poly.size() > 1;id++) {
+      while(alive[id] && poly.size() > 1) {
+         Univariate common = gcd(poly, elements[id]);
+         if(common.size() <= 1) {
+            break;
+         }
+         common.toMonic();
+         if(common == elements[id]) {
+            poly = poly / common;
+            result = combine(result, 1, {{id, 1}}, 1);
+         } else {
+            /* The pieces are appended, and scanned later in this loop */
+            split(id, common);
+         }
+      }
+   }
+
+   if(poly.size() > 1) {
+      poly.toMonic();
+      elements.push_back(poly);
+      alive.push_back(true);
+      expansions.push_back(Factorization());
+      result = combine(result, 1, {{elements.size() - 1, 1}}, 1);
+   }
+   return result;
+}
+
+/* `divisor` is a proper monic factor of element `id` */
+void CoprimeBasis::split(size_t id, const Univariate& divisor) {
+   alive[id] = false;
+   nb_splits++;
+   split_log.push_back(id);
+
+   Univariate rest = elements[id];
+   int multiplicity = 0;
+   while(rest.size() > 1 && isMultipleOf(rest, divisor)) {
+      rest = rest / divisor;
+      multiplicity++;
+   }
+
+   /* The element was coprime to all others, so are its pieces */
+   size_t first = elements.size();
+   Factorization expansion = add(divisor, first);
+   expansion = combine(Factorization(), 1, expansion, multiplicity);
+   if(rest.size() > 1) {
+      expansion = combine(expansion, 1, add(rest, first), 1);
+   }
+   expansions[id] = expansion;
+}
+
+CoprimeBasis::Factorization CoprimeBasis::resolve(const Factorization& factorization) const {
+   Factorization result;
+   for(auto& factor : factorization) {
+      if(alive[factor.first]) {
+         result = combine(result, 1, {{factor.first, 1}}, factor.second);
+      } else {
+         result = combine(result, 1, expand(factor.first), factor.second);
+      }
+   }
+   return result;
+}
+
+CoprimeBasis::Factorization CoprimeBasis::expand(size_t id) const {
+   assert(!alive[id]);
+   return resolve(expansions[id]);
+}
+
+vector<size_t> CoprimeBasis::takeSplitElements() {
+   vector<size_t> split_elements;
+   swap(split_elements, split_log);
+   return split_elements;
+}
+
+vector<size_t> CoprimeBasis::aliveElements() const {
+   vector<size_t> ids;
+   for(size_t id = 0;id < elements.size();id++) {
+      if(alive[id]) {
+         ids.push_back(id);
+      }
+   }
+   return ids;
+}
+
+bool CoprimeBasis::isAlive(size_t id) const {
+   return alive[id];
+}
+
+const Univariate& CoprimeBasis::element(size_t id) const {
+   return elements[id];
+}
+
+size_t CoprimeBasis::nbSplits() const {
+   return nb_splits;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <vector>
+#include "bigint.h"
+#include "matrix.h"
+using namespace std;
+
+/* Largest matrix handled densely, in both dimensions */
+constexpr size_t DENSE_MOD_CAPACITY = 256;
+/* Whether an entry can take DENSE_MOD_CAPACITY updates below modulo^2 on top of
+   its value without overflowing: up to a modulo of about 1.9e8. Above, matrix_rank()
+   always takes the sparse path */
+constexpr bool DENSE_MOD_SUPPORTED =
+   (int64_t)(modulo - 1) * (modulo - 1) <= (INT64_MAX - modulo) / (int64_t)DENSE_MOD_CAPACITY;
+/* Below this many nonzero entries per dense entry, the sparse rows win */
+constexpr size_t DENSE_MOD_MIN_DENSITY_INV = 8;
+
+/*
+ * Dense matrix over Mod, for the small matrices of FArith evaluated at a point.
+ * Entries are int64 and only reduced when read: an update adds less than
+ * modulo^2, so while DENSE_MOD_SUPPORTED a row takes all the updates of an
+ * elimination (one per row above it, fewer than DENSE_MOD_CAPACITY) without
+ * overflowing, and the inner loop is a plain multiply-add over contiguous entries.
+ */
+class DenseMatrixMod {
+public:
+   DenseMatrixMod(const Matrix<Mod>& mat);
+
+   static bool fits(const Matrix<Mod>& mat);
+   static bool preferred(const Matrix<Mod>& mat);
+
+   /* Row echelon form in place */
+   size_t rank();
+private:
+   int64_t* row(size_t iRow) {
+      return coeffs.data() + iRow * nbCols;
+   }
+
+   size_t nbRows, nbCols;
+   vector<int64_t> coeffs;
+};
+
+DenseMatrixMod::DenseMatrixMod(const Matrix<Mod>& mat) {
+   assert(fits(mat));
+   nbRows = mat.nbRows();
+   nbCols = mat.nbCols();
+   coeffs.assign(nbRows * nbCols, 0);
+   for (size_t iRow = 0;iRow < nbRows;iRow++) {
+      for (auto& coeff : mat.coeffs[iRow].coeffs) {
+         row(iRow)[coeff.first] = coeff.second.value;
+      }
+   }
+}
+
+bool DenseMatrixMod::fits(const Matrix<Mod>& mat) {
+   if (!DENSE_MOD_SUPPORTED) {
+      return false;
+   }
+   if (mat.nbRows() > DENSE_MOD_CAPACITY || mat.nbCols() > DENSE_MOD_CAPACITY + 1) {
+      return false;
+   }
+   for (auto& row : mat.coeffs) {
+      if (row.max_index() > mat.nbCols()) {
+         return false;
+      }
+   }
+   return true;
+}
+
+bool DenseMatrixMod::preferred(const Matrix<Mod>& mat) {
+   if (!fits(mat)) {
+      return false;
+   }
+   size_t nb_nonzero = 0;
+   for (auto& row : mat.coeffs) {
+      nb_nonzero += row.size();
+   }
+   return nb_nonzero * DENSE_MOD_MIN_DENSITY_INV >= mat.nbRows() * mat.nbCols();
+}
+
+size_t DenseMatrixMod::rank() {
+   size_t nb_pivots = 0;
+   for (size_t iRow = 0;iRow < nbRows;iRow++) {
+      int64_t* pivot_row = row(iRow);
+      size_t col = nbCols;
+      for (size_t iCol = 0;iCol < nbCols;iCol++) {
+         pivot_row[iCol] %= modulo;
+         if (col == nbCols && pivot_row[iCol] != 0) {
+            col = iCol;
+         }
+      }
+      if (col == nbCols) {
+         continue;
+      }
+      nb_pivots++;
+
+      int64_t pivot_inverse = inverse(Mod((int)pivot_row[col])).value;
+      for (size_t nRow = iRow + 1;nRow < nbRows;nRow++) {
+         int64_t* current = row(nRow);
+         int64_t factor = current[col] % modulo * pivot_inverse % modulo;
+         if (factor == 0) {
+            continue;
+         }
+         int64_t neg = modulo - factor;
+         for (size_t iCol = col;iCol < nbCols;iCol++) {
+            current[iCol] += neg * pivot_row[iCol];
+         }
+      }
+   }
+   return nb_pivots;
+}
+
+/* Picks the dense elimination for small, dense enough matrices */
+size_t matrix_rank(const Matrix<Mod>& mat) {
+   if (DenseMatrixMod::preferred(mat)) {
+      DenseMatrixMod dense(mat);
+      return dense.rank();
+   }
+   return mat.nbRows() - kernel_basis(mat).nbRows();
+}
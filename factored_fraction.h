@@ -0,0 +1,344 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include "coprime_basis.h"
+#include "fraction.h"
+#include "polynomial.h"
+using namespace std;
+
+/*
+ * Pairwise coprime monic polynomials shared by all factored denominators,
+ * referenced by id. Ids are stable: a factor found to share a piece with a new
+ * denominator is split, but stays readable, and its old references resolve to
+ * the pieces. Denominators repeat a lot, so their factorizations are kept, and
+ * only a new one pays for the gcds against the factors.
+ */
+class FactorTable {
+public:
+  typedef CoprimeBasis::Factorization Factors;
+
+  Factors factorize(const Univariate& monic_poly);
+  /* Replaces split factors of `factors` by their pieces */
+  void resolve(Factors& factors);
+  const Univariate& get(size_t id);
+private:
+  Factors resolveLocked(const Factors& factors) const;
+
+  CoprimeBasis basis;
+  map<Univariate, Factors> known;
+  atomic<size_t> nb_splits{0}; /* Read without the lock, to skip resolve() until a split */
+  shared_mutex mtx;
+};
+
+FactorTable::Factors FactorTable::resolveLocked(const Factors& factors) const {
+  for(auto& factor : factors) {
+    if (!basis.isAlive(factor.first)) {
+      return basis.resolve(factors);
+    }
+  }
+  return factors;
+}
+
+FactorTable::Factors FactorTable::factorize(const Univariate& monic_poly) {
+  assert(monic_poly.size() > 1);
+  assert(leading(monic_poly) == Mod(1));
+  {
+    shared_lock<shared_mutex> lock(mtx);
+    auto it = known.find(monic_poly);
+    if (it != known.end()) {
+      return resolveLocked(it->second);
+    }
+  }
+  unique_lock<shared_mutex> lock(mtx);
+  auto it = known.find(monic_poly);
+  if (it == known.end()) {
+    it = known.insert({monic_poly, basis.add(monic_poly)}).first;
+    nb_splits = basis.nbSplits();
+  }
+  return resolveLocked(it->second);
+}
+
+void FactorTable::resolve(Factors& factors) {
+  if (nb_splits == 0) {
+    return;
+  }
+  shared_lock<shared_mutex> lock(mtx);
+  factors = resolveLocked(factors);
+}
+
+/* Elements are never moved, so the reference outlives the lock */
+const Univariate& FactorTable::get(size_t id) {
+  shared_lock<shared_mutex> lock(mtx);
+  return basis.element(id);
+}
+
+FactorTable denominatorFactors;
+
+/*
+ * A rational function whose denominator is kept as a product of factors of
+ * `denominatorFactors`, with the numerator carrying the leading coefficient.
+ * Denominators produced by FArith are products of a few small factors, so the
+ * common denominator of a sum is an lcm on exponents, and reduction only tries
+ * the factors of the denominator instead of a full gcd. Factors are coprime, so
+ * equal denominators have equal factors once resolved.
+ */
+class FactoredFraction {
+public:
+  typedef FactorTable::Factors Factors; /* (factor id, exponent > 0), sorted by id */
+
+  FactoredFraction(const Univariate& _numerator, const Univariate& _denominator);
+  FactoredFraction(const Univariate& _numerator);
+  FactoredFraction(int64_t _constant = 0);
+  const Univariate& getNumerator() const;
+  Univariate getDenominator() const;
+  const Factors& getDenominatorFactors() const;
+  Fraction<Univariate> toFraction() const;
+  void operator += (const FactoredFraction& a);
+  FactoredFraction operator + (const FactoredFraction& a) const;
+  friend FactoredFraction operator - (const FactoredFraction& a);
+  friend FactoredFraction operator * (const FactoredFraction& a, const FactoredFraction& b);
+  friend FactoredFraction inverse(const FactoredFraction& a);
+  friend bool operator == (const FactoredFraction& a, const FactoredFraction& b);
+  friend std::ostream& operator << (std::ostream& out, const FactoredFraction& a);
+
+  static Univariate expand(const Factors& factors);
+private:
+  void setDenominator(Univariate _denominator);
+  void cancel();
+
+  Univariate numerator;
+  Factors denominator;
+};
+
+Univariate FactoredFraction::expand(const Factors& factors) {
+  Univariate product(1);
+  for(auto& factor : factors) {
+    const Univariate& poly = denominatorFactors.get(factor.first);
+    for(int i = 0;i < factor.second;i++) {
+      product = product * poly;
+    }
+  }
+  return product;
+}
+
+/* The numerator takes the leading coefficient of `_denominator` */
+void FactoredFraction::setDenominator(Univariate _denominator) {
+  assert(_denominator.size() > 0);
+  numerator = inverse(leading(_denominator)) * numerator;
+  _denominator.toMonic();
+
+  denominator.clear();
+  if (_denominator.size() > 1) {
+    denominator = denominatorFactors.factorize(_denominator);
+  }
+}
+
+/* Removes the denominator factors that divide the numerator */
+void FactoredFraction::cancel() {
+  if (numerator.size() == 0) {
+    denominator.clear();
+    return;
+  }
+  denominatorFactors.resolve(denominator);
+  Factors remaining;
+  for(auto& factor : denominator) {
+    const Univariate& poly = denominatorFactors.get(factor.first);
+    int exponent = factor.second;
+    while(exponent > 0 && numerator.size() >= poly.size() && isMultipleOf(numerator, poly)) {
+      numerator = numerator / poly;
+      exponent--;
+    }
+    if (exponent > 0) {
+      remaining.push_back({factor.first, exponent});
+    }
+  }
+  denominator = remaining;
+}
+
+FactoredFraction::FactoredFraction(const Univariate& _numerator, const Univariate& _denominator) {
+  numerator = _numerator;
+  setDenominator(_denominator);
+  cancel();
+}
+
+FactoredFraction::FactoredFraction(const Univariate& _numerator) {
+  numerator = _numerator;
+}
+
+FactoredFraction::FactoredFraction(int64_t _constant) {
+  numerator = Univariate(_constant);
+}
+
+const Univariate& FactoredFraction::getNumerator() const {
+  return numerator;
+}
+
+Univariate FactoredFraction::getDenominator() const {
+  return expand(denominator);
+}
+
+const FactoredFraction::Factors& FactoredFraction::getDenominatorFactors() const {
+  return denominator;
+}
+
+Fraction<Univariate> FactoredFraction::toFraction() const {
+  /* Factors are coprime but not irreducible, so the numerator can share a piece of one */
+  return Fraction<Univariate>(numerator, getDenominator());
+}
+
+/* Exponents of the lcm of `a` and `b`, and of the cofactors lcm/a and lcm/b */
+static void factors_lcm(const FactoredFraction::Factors& a, const FactoredFraction::Factors& b,
+                        FactoredFraction::Factors& lcm,
+                        FactoredFraction::Factors& cofactor_a, FactoredFraction::Factors& cofactor_b) {
+  size_t c_a = 0;
+  size_t c_b = 0;
+  while (c_a < a.size() || c_b < b.size()) {
+    if (c_b == b.size() || (c_a < a.size() && a[c_a].first < b[c_b].first)) {
+      lcm.push_back(a[c_a]);
+      cofactor_b.push_back(a[c_a++]);
+    } else if (c_a == a.size() || b[c_b].first < a[c_a].first) {
+      lcm.push_back(b[c_b]);
+      cofactor_a.push_back(b[c_b++]);
+    } else {
+      size_t id = a[c_a].first;
+      int e_a = a[c_a++].second;
+      int e_b = b[c_b++].second;
+      lcm.push_back({id, max(e_a, e_b)});
+      if (e_a < e_b) {
+        cofactor_a.push_back({id, e_b - e_a});
+      } else if (e_b < e_a) {
+        cofactor_b.push_back({id, e_a - e_b});
+      }
+    }
+  }
+}
+
+void FactoredFraction::operator += (const FactoredFraction& a) {
+  if (a.numerator.size() == 0) {
+    return;
+  }
+  if (denominator == a.denominator) {
+    numerator = numerator + a.numerator;
+    cancel();
+    return;
+  }
+  Factors lcm, cofactor, cofactor_a;
+  factors_lcm(denominator, a.denominator, lcm, cofactor, cofactor_a);
+  numerator = numerator * expand(cofactor) + a.numerator * expand(cofactor_a);
+  denominator = lcm;
+  cancel();
+}
+
+FactoredFraction FactoredFraction::operator + (const FactoredFraction& a) const {
+  FactoredFraction res = *this;
+  res += a;
+  return res;
+}
+
+FactoredFraction operator - (const FactoredFraction& a) {
+  FactoredFraction res = a;
+  res.numerator = -res.numerator;
+  return res;
+}
+
+FactoredFraction operator - (const FactoredFraction& a, const FactoredFraction& b) {
+  return a + (-b);
+}
+
+FactoredFraction operator * (const FactoredFraction& a, const FactoredFraction& b) {
+  FactoredFraction res;
+  res.numerator = a.numerator * b.numerator;
+  if (res.numerator.size() == 0) {
+    return res;
+  }
+  size_t c_a = 0;
+  size_t c_b = 0;
+  while (c_a < a.denominator.size() || c_b < b.denominator.size()) {
+    if (c_b == b.denominator.size()
+        || (c_a < a.denominator.size() && a.denominator[c_a].first < b.denominator[c_b].first)) {
+      res.denominator.push_back(a.denominator[c_a++]);
+    } else if (c_a == a.denominator.size() || b.denominator[c_b].first < a.denominator[c_a].first) {
+      res.denominator.push_back(b.denominator[c_b++]);
+    } else {
+      size_t id = a.denominator[c_a].first;
+      res.denominator.push_back({id, a.denominator[c_a++].second + b.denominator[c_b++].second});
+    }
+  }
+  res.cancel();
+  return res;
+}
+
+FactoredFraction inverse(const FactoredFraction& a) {
+  return FactoredFraction(a.getDenominator(), a.numerator);
+}
+
+FactoredFraction operator / (const FactoredFraction& a, const FactoredFraction& b) {
+  return a * inverse(b);
+}
+
+bool is_zero(const FactoredFraction& a) {
+  return a.getNumerator().size() == 0;
+}
+
+bool operator == (const FactoredFraction& a, const FactoredFraction& b) {
+  if (a.denominator == b.denominator) {
+    return a.numerator == b.numerator;
+  }
+  FactoredFraction::Factors lcm, cofactor_a, cofactor_b;
+  factors_lcm(a.denominator, b.denominator, lcm, cofactor_a, cofactor_b);
+  return a.numerator * FactoredFraction::expand(cofactor_a) == b.numerator * FactoredFraction::expand(cofactor_b);
+}
+
+bool operator != (const FactoredFraction& a, const FactoredFraction& b) {
+  return !(a == b);
+}
+
+std::ostream& operator << (std::ostream& out, const FactoredFraction& a) {
+  out << toString(a.numerator, "x") << KGRN "/" KRST;
+  if (a.denominator.empty()) {
+    out << "1";
+  }
+  for(auto& factor : a.denominator) {
+    out << toString(denominatorFactors.get(factor.first), "x");
+    if (factor.second != 1) {
+      out << "^" << factor.second;
+    }
+  }
+  return out;
+}
+
+Fraction<Univariate> toFraction(const FactoredFraction& a) {
+  return a.toFraction();
+}
+
+Fraction<Univariate> toFraction(const Fraction<Univariate>& a) {
+  return a;
+}
+
+/* False when the denominator vanishes at `point` */
+bool evaluate(const FactoredFraction& a, const Mod& point, Mod& value) {
+  Mod denominator = 1;
+  for(auto& factor : a.getDenominatorFactors()) {
+    Mod factor_value = evaluate(denominatorFactors.get(factor.first), point);
+    for(int i = 0;i < factor.second;i++) {
+      denominator = denominator * factor_value;
+    }
+  }
+  if (denominator == Mod(0)) {
+    return false;
+  }
+  value = evaluate(a.getNumerator(), point) * inverse(denominator);
+  return true;
+}
+
+bool evaluate(const Fraction<Univariate>& a, const Mod& point, Mod& value) {
+  Mod denominator = evaluate(a.getDenominator(), point);
+  if (denominator == Mod(0)) {
+    return false;
+  }
+  value = evaluate(a.getNumerator(), point) * inverse(denominator);
+  return true;
+}
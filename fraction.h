@@ -1,4 +1,5 @@
 #pragma once
+#include <atomic>
 #include <cassert>
 #include "bigint.h"
 #include "print.h"
@@ -7,33 +8,70 @@ using namespace std;
 template<typename T>
 class Fraction {
 public:
+  /* Without `simplify`, the gcd is skipped and the fraction is left unnormalized */
   Fraction(const T& _numerator, const T& _denominator, bool simplify=true);
   Fraction(const T& _numerator);
   Fraction(int64_t _constant = 0);
+  /* For a numerator and denominator known to be in lowest terms, as normalize() leaves them */
+  static Fraction<T> fromReduced(const T& _numerator, const T& _denominator);
   T getNumerator() const;
   T getDenominator() const;
+  bool isNormalized() const;
+  void normalize();
   void operator += (const Fraction<T>& a);
   Fraction<T> operator + (const Fraction<T>& a) const;
   template<class U>
   friend std::ostream& operator << (std::ostream& out,const Fraction<U>& a);
+  template<class U>
+  friend Fraction<U> operator - (const Fraction<U>& a);
+  template<class U>
+  friend Fraction<U> inverse(const Fraction<U>& a);
+
+  /*
+   * Lazy normalization: when non-zero, `+=` and `*` skip the gcd until the
+   * numerator or denominator degree goes past this threshold. Comparisons stay
+   * exact, and `normalize()` reduces on demand. 0 (the default) always reduces.
+   * A fraction is only marked normalized once it has actually been reduced,
+   * and the predicates below reduce a copy of those that are not.
+   */
+  static size_t lazy_threshold;
+  /* Only counted in lazy mode */
+  static std::atomic<size_t> nb_gcd_computed;
+  static std::atomic<size_t> nb_gcd_avoided;
 private:
+  void lazyNormalize();
   T numerator, denominator;
+  bool normalized = true;
 };
 
+template<typename T>
+size_t Fraction<T>::lazy_threshold = 0;
+
+template<typename T>
+std::atomic<size_t> Fraction<T>::nb_gcd_computed(0);
+
+template<typename T>
+std::atomic<size_t> Fraction<T>::nb_gcd_avoided(0);
+
 template<typename T>
 Fraction<T>::Fraction(const T& _numerator, const T& _denominator, bool simplify) {
   numerator = _numerator;
   denominator = _denominator;
+  normalized = false;
 
   if (simplify) {
-    T factor = normalFactor(numerator, denominator);
-    if (normalFactorCanReduce(factor)) {
-      numerator = numerator / factor;
-      denominator = denominator / factor;
-    }
+    lazyNormalize();
   }
 }
 
+template<typename T>
+Fraction<T> Fraction<T>::fromReduced(const T& _numerator, const T& _denominator) {
+  Fraction<T> res;
+  res.numerator = _numerator;
+  res.denominator = _denominator;
+  return res;
+}
+
 template<typename T>
 Fraction<T>::Fraction(const T& _numerator) {
   numerator = _numerator;
@@ -56,6 +94,38 @@ T Fraction<T>::getDenominator() const {
   return denominator;
 }
 
+template<typename T>
+bool Fraction<T>::isNormalized() const {
+  return normalized;
+}
+
+template<typename T>
+void Fraction<T>::normalize() {
+  if (normalized) {
+    return;
+  }
+  if (lazy_threshold != 0) {
+    nb_gcd_computed++;
+  }
+  T factor = normalFactor(numerator, denominator);
+  if (normalFactorCanReduce(factor)) {
+    numerator = numerator / factor;
+    denominator = denominator / factor;
+  }
+  normalized = true;
+}
+
+template<typename T>
+void Fraction<T>::lazyNormalize() {
+  if ((lazy_threshold != 0)
+      && (normalDegree(numerator) <= lazy_threshold)
+      && (normalDegree(denominator) <= lazy_threshold)) {
+    nb_gcd_avoided++;
+    return;
+  }
+  normalize();
+}
+
 template<typename T>
 void Fraction<T>::operator += (const Fraction<T>& a) {
   if (0) {
@@ -75,11 +145,8 @@ void Fraction<T>::operator += (const Fraction<T>& a) {
     numerator = numerator * a.denominator + denominator * a.numerator;
     denominator = denominator * a.denominator;
 
-    T factor = normalFactor(numerator, denominator);
-    if (normalFactorCanReduce(factor)) {
-      numerator = numerator / factor;
-      denominator = denominator / factor;
-    }
+    normalized = false;
+    lazyNormalize();
   }
 }
 
@@ -92,6 +159,9 @@ Fraction<T> Fraction<T>::operator + (const Fraction<T>& a) const {
 
 template<class T>
 std::ostream& operator << (std::ostream& out,const Fraction<T>& a) {
+  if (!a.isNormalized()) {
+    return out << reduced(a);
+  }
   out << toString(a.getNumerator(), "x") << KGRN "/" KRST
       << toString(a.getDenominator(), "x");
   return out;
@@ -104,6 +174,10 @@ bool is_zero(const Fraction<T>& a) {
 
 template<typename T>
 bool operator == (const Fraction<T>& a, const Fraction<T>& b) {
+  if (!a.isNormalized() || !b.isNormalized()) {
+    /* Exact without a gcd */
+    return a.getNumerator() * b.getDenominator() == b.getNumerator() * a.getDenominator();
+  }
   return (a.getNumerator() == b.getNumerator()) && (a.getDenominator() == b.getDenominator());
 }
 
@@ -114,7 +188,9 @@ bool operator != (const Fraction<T>& a, const Fraction<T>& b) {
 
 template<typename T>
 Fraction<T> operator - (const Fraction<T>& a) {
-  return Fraction<T>(-a.getNumerator(), a.getDenominator(), false);
+  Fraction<T> res = Fraction<T>::fromReduced(-a.numerator, a.denominator);
+  res.normalized = a.normalized;
+  return res;
 }
 
 template<typename T>
@@ -132,13 +208,15 @@ Fraction<T> operator * (const Fraction<T>& a, const Fraction<T>& b) {
 
 template<typename T>
 Fraction<T> inverse(const Fraction<T>& a) {
-  T numerator = a.getNumerator();
-  T denominator = a.getDenominator();
+  T numerator = a.numerator;
+  T denominator = a.denominator;
   if (numerator < T(0)) {
       numerator = -numerator;
       denominator = -denominator;
   }
-  return Fraction<T>(denominator, numerator, false);
+  Fraction<T> res = Fraction<T>::fromReduced(denominator, numerator);
+  res.normalized = a.normalized;
+  return res;
 }
 
 template<typename T>
@@ -146,8 +224,16 @@ Fraction<T> operator / (const Fraction<T>& a, const Fraction<T>& b) {
   return a * inverse(b);
 }
 
+template<typename T>
+Fraction<T> reduced(Fraction<T> a) {
+  a.normalize();
+  return a;
+}
+
 template<typename T>
 string toString(const Fraction<T>& a) {
+  if(!a.isNormalized())
+    return toString(reduced(a));
   if(a.getNumerator() == T(0))
     return "0";
   if(a.getDenominator() == T(1))
@@ -157,6 +243,9 @@ string toString(const Fraction<T>& a) {
 
 template<typename T>
 bool is_positive(const Fraction<T>& a) {
+  if (!a.isNormalized()) {
+    return is_positive(reduced(a));
+  }
   assert(a.getDenominator() > T(0));
   return a.getNumerator() > T(0);
 }
@@ -178,6 +267,9 @@ bool operator > (const Fraction<T>& a, const Fraction<T>& b) {
 
 template<typename T>
 bool is_integer(const Fraction<T>& a) {
+  if (!a.isNormalized()) {
+    return is_integer(reduced(a));
+  }
   return a.getDenominator() == T(1);
 }
 
@@ -189,5 +281,6 @@ ostream& operator << (ostream& out, const Rational &r) {
 }
 
 Rational round(Rational a) {
+   a.normalize();
    return Rational((a.getNumerator() + a.getDenominator() / 2) / a.getDenominator());
 }
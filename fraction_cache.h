@@ -0,0 +1,266 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "checkpoint.h"
+#include "hformula.h"
+#include "polynomial.h"
+using namespace std;
+
+/*
+ * Persistent cache of get_fraction() results, shared by runs with different
+ * constraints. The file is a header followed by records that are only ever
+ * appended, each made of native 32-bit words:
+ *
+ *   key (2 words), nb_words of the rest, checksum of the rest,
+ *   name length in bytes, name (padded to a word), number of states,
+ *   numerator, denominator in lowest terms (number of coefficients, then the coefficients)
+ *
+ * The key is the FNV-1a hash of the plain name and the modulus, so that one
+ * file can serve several moduli; the name is kept to rule out collisions.
+ * Existing records are read in place from a mapping of the file.
+ *
+ * Other runs may append to the file at any time, so it is never truncated:
+ * each record is appended by a single write() in O_APPEND mode, and a record
+ * cut short by an interrupted run is skipped when the file is next read, the
+ * scan going on from the next byte where a record with a valid checksum
+ * starts. Records are read with memcpy(), as one after a cut record may not
+ * start on a word boundary.
+ */
+constexpr char FRACTION_CACHE_MAGIC[8] = {'C', 'R', 'Z', 'C', 'A', 'C', 'H', 'E'};
+constexpr uint32_t FRACTION_CACHE_VERSION = 2;
+
+struct FractionCacheHeader {
+   char magic[8];
+   uint32_t version;
+   uint32_t reserved;
+};
+
+class FractionCache {
+public:
+   FractionCache() = default;
+   ~FractionCache();
+   FractionCache(const FractionCache&) = delete;
+   FractionCache& operator=(const FractionCache&) = delete;
+
+   /* Opens or creates the cache file; the cache stays disabled on failure */
+   void open(const string& path);
+   bool enabled() const;
+
+   bool lookup(const HFormula& name, Fraction<Univariate>& frac, size_t& nb_states);
+   void store(const HFormula& name, const Fraction<Univariate>& frac, size_t nb_states);
+
+   size_t nbHits() const;
+   size_t nbMisses() const;
+private:
+   int fd = -1;
+   void* mapping = MAP_FAILED;
+   size_t mapping_size = 0;
+   /* Records stored by this run, which the mapping does not cover */
+   vector<unsigned char> appended;
+   /* Byte offset of the record of each key: in the mapping, then past its end in `appended` */
+   unordered_map<uint64_t, size_t> offsets;
+   size_t nb_hits = 0;
+   size_t nb_misses = 0;
+
+   static string keyName(const HFormula& name);
+   static uint64_t key(const string& name);
+   static uint32_t getWord(const unsigned char*& cursor);
+   static void putPolynomial(vector<uint32_t>& words, const Univariate& poly);
+   static Univariate getPolynomial(const unsigned char*& cursor);
+   const unsigned char* record(size_t offset) const;
+   /* Indexes the valid records; returns the number of bytes skipped */
+   size_t scan(const unsigned char* bytes, size_t size);
+};
+
+FractionCache::~FractionCache() {
+   if(fd >= 0) {
+      close(fd);
+   }
+   if(mapping != MAP_FAILED) {
+      munmap(mapping, mapping_size);
+   }
+}
+
+string FractionCache::keyName(const HFormula& name) {
+   ostringstream plain;
+   plain << name;
+   return plain.str();
+}
+
+uint64_t FractionCache::key(const string& name) {
+   uint32_t modulus = modulo;
+   return fnv1a(&modulus, sizeof(modulus), fnv1a(name.data(), name.size()));
+}
+
+uint32_t FractionCache::getWord(const unsigned char*& cursor) {
+   uint32_t word;
+   memcpy(&word, cursor, sizeof(word));
+   cursor += sizeof(word);
+   return word;
+}
+
+void FractionCache::putPolynomial(vector<uint32_t>& words, const Univariate& poly) {
+   words.push_back(poly.size());
+   for(size_t iCoeff = 0;iCoeff < poly.size();iCoeff++) {
+      words.push_back(poly.getCoeff(iCoeff).value);
+   }
+}
+
+Univariate FractionCache::getPolynomial(const unsigned char*& cursor) {
+   vector<Mod> coeffs;
+   size_t size = getWord(cursor);
+   coeffs.reserve(size);
+   for(size_t iCoeff = 0;iCoeff < size;iCoeff++) {
+      coeffs.push_back(Mod(getWord(cursor)));
+   }
+   return Univariate(move(coeffs));
+}
+
+const unsigned char* FractionCache::record(size_t offset) const {
+   if(offset < mapping_size) {
+      return (const unsigned char*)mapping + offset;
+   }
+   return appended.data() + (offset - mapping_size);
+}
+
+size_t FractionCache::scan(const unsigned char* bytes, size_t size) {
+   const size_t record_header = 4 * sizeof(uint32_t);
+   size_t offset = sizeof(FractionCacheHeader);
+   size_t nb_skipped = 0;
+   while(offset + record_header <= size) {
+      const unsigned char* cursor = bytes + offset;
+      uint64_t record_key = getWord(cursor);
+      record_key |= (uint64_t)getWord(cursor) << 32;
+      size_t rest_size = (size_t)getWord(cursor) * sizeof(uint32_t);
+      uint32_t checksum = getWord(cursor);
+      if(rest_size <= size - offset - record_header && checksum == (uint32_t)fnv1a(cursor, rest_size)) {
+         offsets.insert({record_key, offset});
+         offset += record_header + rest_size;
+      } else {
+         nb_skipped++;
+         offset++;
+      }
+   }
+   return nb_skipped + (size - offset);
+}
+
+void FractionCache::open(const string& path) {
+   fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+   if(fd < 0) {
+      cerr << KRED "Cannot open fraction cache " << path << KRST << endl;
+      return;
+   }
+   struct stat file_stat;
+   if(fstat(fd, &file_stat) != 0) {
+      close(fd);
+      fd = -1;
+      return;
+   }
+
+   if(file_stat.st_size == 0) {
+      /* Two runs creating the file at once both write a header: the second is skipped as a bad record */
+      FractionCacheHeader header;
+      memcpy(header.magic, FRACTION_CACHE_MAGIC, sizeof(header.magic));
+      header.version = FRACTION_CACHE_VERSION;
+      header.reserved = 0;
+      if(write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+         close(fd);
+         fd = -1;
+      }
+      return;
+   }
+
+   mapping_size = file_stat.st_size;
+   mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   const FractionCacheHeader* header = (const FractionCacheHeader*)mapping;
+   if(mapping == MAP_FAILED || mapping_size < sizeof(FractionCacheHeader)
+      || memcmp(header->magic, FRACTION_CACHE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != FRACTION_CACHE_VERSION) {
+      cerr << KRED "Ignoring fraction cache " << path << ": not a cache of version "
+           << FRACTION_CACHE_VERSION << KRST << endl;
+      close(fd);
+      fd = -1;
+      return;
+   }
+   size_t nb_skipped = scan((const unsigned char*)mapping, mapping_size);
+   if(nb_skipped != 0) {
+      cerr << KGRY "Fraction cache " << path << ": skipped " << nb_skipped << " bytes of damaged records" KRST << endl;
+   }
+}
+
+bool FractionCache::enabled() const {
+   return fd >= 0;
+}
+
+bool FractionCache::lookup(const HFormula& name, Fraction<Univariate>& frac, size_t& nb_states) {
+   if(!enabled()) {
+      return false;
+   }
+   string plain = keyName(name);
+   auto it = offsets.find(key(plain));
+   if(it == offsets.end()) {
+      nb_misses++;
+      return false;
+   }
+   const unsigned char* cursor = record(it->second) + 4 * sizeof(uint32_t);
+   size_t name_size = getWord(cursor);
+   if(name_size != plain.size() || memcmp(cursor, plain.data(), name_size) != 0) {
+      nb_misses++;
+      return false;
+   }
+   cursor += (name_size + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+   nb_states = getWord(cursor);
+   Univariate numerator = getPolynomial(cursor);
+   Univariate denominator = getPolynomial(cursor);
+   frac = Fraction<Univariate>::fromReduced(numerator, denominator);
+   nb_hits++;
+   return true;
+}
+
+void FractionCache::store(const HFormula& name, const Fraction<Univariate>& frac, size_t nb_states) {
+   string plain = keyName(name);
+   uint64_t record_key = key(plain);
+   if(offsets.count(record_key) != 0) {
+      return;
+   }
+
+   vector<uint32_t> words(4, 0);
+   words.push_back(plain.size());
+   size_t name_words = (plain.size() + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+   words.resize(words.size() + name_words, 0);
+   memcpy(words.data() + 5, plain.data(), plain.size());
+   words.push_back(nb_states);
+   putPolynomial(words, frac.getNumerator());
+   putPolynomial(words, frac.getDenominator());
+
+   size_t nb_rest = words.size() - 4;
+   words[0] = (uint32_t)(record_key & 0xFFFFFFFF);
+   words[1] = (uint32_t)(record_key >> 32);
+   words[2] = nb_rest;
+   words[3] = (uint32_t)fnv1a(words.data() + 4, nb_rest * sizeof(uint32_t));
+
+   /* One write, so that the records of concurrent runs do not interleave */
+   size_t size = words.size() * sizeof(uint32_t);
+   if(write(fd, words.data(), size) != (ssize_t)size) {
+      return;
+   }
+   offsets.insert({record_key, mapping_size + appended.size()});
+   appended.insert(appended.end(), (const unsigned char*)words.data(), (const unsigned char*)words.data() + size);
+}
+
+size_t FractionCache::nbHits() const {
+   return nb_hits;
+}
+
+size_t FractionCache::nbMisses() const {
+   return nb_misses;
+}
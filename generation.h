@@ -1,6 +1,11 @@
 #pragma once
+#include <algorithm>
+#include <memory>
+#include <sstream>
 #include <unordered_map>
 #include "arith_f.h"
+#include "fraction_cache.h"
+#include "metrics.h"
 #include "relations.h"
 
 typedef struct GenerationFacts {
@@ -24,6 +29,7 @@ typedef struct GenerationConstraintLine {
     int min_exp;
     int max_exp;
     GenerationConstraintExtraArg extra_constraint;
+    int compose = 1; /* Generate n -> f(n^compose) instead of f */
 } GenerationConstraintLine;
 
 typedef struct GenerationConstraint {
@@ -34,6 +40,66 @@ typedef struct GenerationConstraint {
     int max_score;
 } GenerationConstraint;
 
+/* Names of the leaves in GEN_LEAVES: their LeafType, lower case, without the prefix */
+static const pair<const char*, FormulaNode::LeafType> generation_leaf_names[] = {
+    {"theta", FormulaNode::LEAF_THETA},
+    {"zetak", FormulaNode::LEAF_ZETAK},
+    {"mu", FormulaNode::LEAF_MU},
+    {"nu", FormulaNode::LEAF_NU},
+    {"sigma", FormulaNode::LEAF_SIGMA},
+    {"xi", FormulaNode::LEAF_XI},
+    {"sigma_prime", FormulaNode::LEAF_SIGMA_PRIME},
+    {"tauk", FormulaNode::LEAF_TAUK},
+    {"jordan_t", FormulaNode::LEAF_JORDAN_T},
+    {"liouville", FormulaNode::LEAF_LIOUVILLE},
+};
+
+/* Keeps the lines whose leaf is in `names`, a comma-separated list; returns false on an unknown name */
+static bool filter_generation_lines(const GenerationConstraintLine* lines, size_t lines_count, const string& names,
+                                    vector<GenerationConstraintLine>& kept)
+{
+    vector<FormulaNode::LeafType> leaf_types;
+    stringstream stream(names);
+    string name;
+    while (getline(stream, name, ',')) {
+        auto it = find_if(begin(generation_leaf_names), end(generation_leaf_names),
+                          [&name](const pair<const char*, FormulaNode::LeafType>& leaf) {
+            return name == leaf.first;
+        });
+        if (it == end(generation_leaf_names)) {
+            return false;
+        }
+        leaf_types.push_back(it->second);
+    }
+
+    kept.clear();
+    for (size_t iLine = 0; iLine < lines_count; iLine++) {
+        if (find(leaf_types.begin(), leaf_types.end(), lines[iLine].leaf_type) != leaf_types.end()) {
+            kept.push_back(lines[iLine]);
+        }
+    }
+    return true;
+}
+
+/*
+ * Hash of what decides the fractions of a run and how they are stored: the
+ * effective constraints, the denominators mode and the pipelined mode.
+ * Hashed field by field, as the structs have padding.
+ */
+static uint64_t checkpoint_configuration(const GenerationConstraint& constraint, bool pipelined)
+{
+    vector<int64_t> fields;
+    for (size_t iLine = 0; iLine < constraint.lines_count; iLine++) {
+        const GenerationConstraintLine& line = constraint.lines[iLine];
+        fields.insert(fields.end(), {line.leaf_type, line.min_exp, line.max_exp,
+                                     line.extra_constraint.min_k, line.extra_constraint.max_k,
+                                     line.extra_constraint.min_l, line.extra_constraint.max_l, line.compose});
+    }
+    fields.insert(fields.end(), {(int64_t)constraint.lines_count, constraint.min_sum, constraint.max_sum,
+                                 constraint.max_score, FARITH_FACTORED_DENOMINATORS, pipelined});
+    return fnv1a(fields.data(), fields.size() * sizeof(int64_t));
+}
+
 static void facts_vector_helper(std::vector<int>& vec, size_t idx, int exp) {
     while(!(idx < vec.size())) {
         vec.push_back(0);
@@ -41,6 +107,49 @@ static void facts_vector_helper(std::vector<int>& vec, size_t idx, int exp) {
     vec[idx] += exp;
 }
 
+/*
+ * Product of a parent with more factors, only computed when first needed:
+ * a subtree whose fractions are all in the cache builds no FArith at all.
+ */
+class LazyFArith {
+public:
+    LazyFArith(const FArith& _value) : value(std::make_unique<FArith>(_value)) {}
+    LazyFArith(std::shared_ptr<const LazyFArith> _parent, vector<FArith> _factors)
+        : parent(_parent), factors(_factors) {}
+
+    const FArith& get() const {
+        if (!value) {
+            factors.insert(factors.begin(), parent->get());
+            value = std::make_unique<FArith>(product(factors));
+            factors.clear();
+        }
+        return *value;
+    }
+private:
+    std::shared_ptr<const LazyFArith> parent;
+    mutable vector<FArith> factors;
+    mutable std::unique_ptr<FArith> value;
+};
+
+/* Fractions are cached in plain form and in lowest terms, whatever FArithScalar is */
+static FArithScalar from_cached_fraction(const Fraction<Univariate>& frac)
+{
+#if FARITH_FACTORED_DENOMINATORS
+    return FArithScalar(frac.getNumerator(), frac.getDenominator());
+#else
+    return frac;
+#endif
+}
+
+static Fraction<Univariate> to_cached_fraction(const FArithScalar& frac)
+{
+#if FARITH_FACTORED_DENOMINATORS
+    return Fraction<Univariate>(frac.getNumerator(), frac.getDenominator());
+#else
+    return reduced(frac);
+#endif
+}
+
 static bool bad_formula(GenerationFacts facts)
 {
     /* Avoid generating C-8: J_2µ == φσµ */
@@ -56,16 +165,16 @@ static bool bad_formula(GenerationFacts facts)
 }
 
 static HFormula name_append_component(const HFormula& name, FormulaNode::LeafType component,
-                                      int extra_k, int extra_l, int power)
+                                      int extra_k, int extra_l, int power, int compose)
 {
     return HFormulaProduct(name, HFormulaPower(
-               HFormulaLeaf(component, (FormulaNode::LeafExtraArg){.k = extra_k, .l = extra_l}), power));
+               HFormulaLeaf(component, (FormulaNode::LeafExtraArg){.k = extra_k, .l = extra_l}, compose), power));
 }
 
-static void add_relations(RelationGenerator &manager, Latex& latex,
+static void add_relations(RelationGenerator &manager, Latex& latex, FractionCache& fraction_cache,
                           const GenerationConstraint& generation_constraints,
                           size_t constraint_idx, int extra_k, int extra_l,
-                          const FArith& formula, const HFormula& name, int sum, int score,
+                          const std::shared_ptr<const LazyFArith>& formula, const HFormula& name, int sum, int score,
                           GenerationFacts facts)
 {
     if (score > generation_constraints.max_score) {
@@ -77,20 +186,20 @@ static void add_relations(RelationGenerator &manager, Latex& latex,
         extra_k = max(extra_k, gc->extra_constraint.min_k);
         extra_l = max(extra_l, gc->extra_constraint.min_l);
         if (extra_l > gc->extra_constraint.max_l) {
-            add_relations(manager, latex, generation_constraints,
+            add_relations(manager, latex, fraction_cache, generation_constraints,
                           constraint_idx, extra_k+1, 0,
                           formula, name, sum, score, facts);
             return;
         }
         if (extra_k > gc->extra_constraint.max_k) {
-            add_relations(manager, latex, generation_constraints,
+            add_relations(manager, latex, fraction_cache, generation_constraints,
                           constraint_idx+1, 0, 0,
                           formula, name, sum, score, facts);
             return;
         }
 
         if (gc->min_exp == 0) {
-            add_relations(manager, latex, generation_constraints,
+            add_relations(manager, latex, fraction_cache, generation_constraints,
                           constraint_idx, extra_k, extra_l+1,
                           formula, name, sum, score, facts);
         }
@@ -168,13 +277,19 @@ static void add_relations(RelationGenerator &manager, Latex& latex,
                 default:
                     assert(false); /* Unknown leaf */
             }
-            fformula = formula * pow(fformula, exp);
-            HFormula nname = name_append_component(name, gc->leaf_type, extra_k, extra_l, exp);
+            if (gc->compose != 1) {
+                /* The facts describe plain leaves, so they ignore composed ones */
+                ffacts = facts;
+                fformula = precompose_with_kth_power(fformula, gc->compose);
+                sum_extra *= gc->compose;
+            }
+            auto fformula_lazy = std::make_shared<const LazyFArith>(formula, vector<FArith>(exp, fformula));
+            HFormula nname = name_append_component(name, gc->leaf_type, extra_k, extra_l, exp, gc->compose);
             int ssum = sum + (sum_extra * exp);
             int sscore = score + extra_k + extra_l + exp;
-            add_relations(manager, latex, generation_constraints,
+            add_relations(manager, latex, fraction_cache, generation_constraints,
                           constraint_idx, extra_k, extra_l+1,
-                          fformula, nname, ssum, sscore, ffacts);
+                          fformula_lazy, nname, ssum, sscore, ffacts);
         }
     } else {
         if ((score == 0) || bad_formula(facts)) {
@@ -183,18 +298,33 @@ static void add_relations(RelationGenerator &manager, Latex& latex,
         int min_s = 2 + sum + generation_constraints.min_sum;
         int max_s = min_s + generation_constraints.max_sum;
         for (int s=min_s; s<=max_s; s++) {
-            auto t3 = std::chrono::high_resolution_clock::now();
-            FArith fformula = formula * pow(inv_id(), s);
-            Fraction<Univariate> frac = fformula.get_fraction();
-            auto t4 = std::chrono::high_resolution_clock::now();
             HFormula fname = HFormulaLFunction(name, s);
+            if (manager.hasFraction(fname)) {
+                continue; /* Added by a previous round */
+            }
+            MetricTimer fraction_timer(METRIC_FRACTION);
+            Fraction<Univariate> cached;
+            size_t nb_states;
+            FArithScalar frac;
+            if (fraction_cache.lookup(fname, cached, nb_states)) {
+                frac = from_cached_fraction(cached);
+            } else {
+                vector<FArith> factors(s, inv_id());
+                factors.insert(factors.begin(), formula->get());
+                FArith fformula = product(factors);
+                frac = fformula.get_fraction();
+                nb_states = fformula.A.nbCols();
+                if (fraction_cache.enabled()) {
+                    fraction_cache.store(fname, to_cached_fraction(frac), nb_states);
+                }
+            }
+            float elapsed = fraction_timer.stop();
 
             manager.addFraction(fname, frac);
 
             if (1) {
-                std::chrono::duration<float> elapsed = t4 - t3;
                 cout << KBLD << fname << KRST
-                     << KGRY "   [" << fformula.A.nbCols() << "]  (" << elapsed.count() << "s)" KRST << endl;
+                     << KGRY "   [" << nb_states << "]  (" << elapsed << "s)" KRST << endl;
             }
             if (0) {
                 cout << frac << endl;
@@ -204,10 +334,10 @@ static void add_relations(RelationGenerator &manager, Latex& latex,
     }
 }
 
-static void add_relations(RelationGenerator &manager, Latex& latex,
+static void add_relations(RelationGenerator &manager, Latex& latex, FractionCache& fraction_cache,
                           const GenerationConstraint& generation_constraints)
 {
-    FArith formula = one();
+    auto formula = std::make_shared<const LazyFArith>(one());
     HFormula name = HFormulaOne(); /* https://youtu.be/i8knduidWCw */
     int sum = 0;
     int score = 0;
@@ -221,12 +351,12 @@ static void add_relations(RelationGenerator &manager, Latex& latex,
         .max_sum = 6*(generation_constraints.max_sum+generation_constraints.max_score),
         .max_score = 1,
     };
-    add_relations(manager, latex, zeta_constraints,
+    add_relations(manager, latex, fraction_cache, zeta_constraints,
                   0, 0, 0,
                   formula, name, sum, 1, facts);
 
     /* Add all other relations */
-    add_relations(manager, latex, generation_constraints,
+    add_relations(manager, latex, fraction_cache, generation_constraints,
                   0, 0, 0,
                   formula, name, sum, score, facts);
 }
@@ -1,27 +1,61 @@
 #pragma once
 #include <cassert>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <regex>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 class HFormula {
 public:
     class Node;
 
 protected:
+    /* Interned: structurally equal formulas share the same node */
     std::shared_ptr<const Node> formula;
     HFormula() {}
 
+    /* The node structurally equal to `node` in the global table, added if needed */
+    static std::shared_ptr<const Node> intern(const Node& node);
+
 public:
     const Node* get() const {
         return formula.get();
     }
+    size_t hash() const;
+
+    friend bool operator == (const HFormula& a, const HFormula& b) {
+        return a.formula == b.formula;
+    }
+    friend bool operator != (const HFormula& a, const HFormula& b) {
+        return a.formula != b.formula;
+    }
+};
+
+struct HFormulaHash {
+    size_t operator () (const HFormula& h) const {
+        return h.hash();
+    }
 };
 
 class HFormula::Node {
 public:
     class Symbolic {
     public:
+        /* Variables are lowercase letters, numbered from 0 for 'a' */
+        static const int NB_VARIABLES = 26;
+
+        /* A constant times a product of variables, e.g. -2*k*s */
+        struct Term {
+            int64_t coeff;
+            std::vector<int> vars;
+        };
+
         std::string str;
+        std::vector<Term> terms; /* `str` as a sum of terms, parsed once */
 
         Symbolic() {
             /* Nothing to do */
@@ -29,8 +63,48 @@ public:
 
         Symbolic(std::string value) {
             str = value;
+            compile();
         }
 
+    private:
+        /* Splits like "s+-2*k" on '+', then each term on '*' */
+        static std::vector<std::string> split(const std::string& s, char delimiter) {
+            std::vector<std::string> tokens;
+            size_t prev = 0;
+            size_t pos = 0;
+            do {
+                pos = s.find(delimiter, prev);
+                if (pos == std::string::npos) {
+                    pos = s.length();
+                }
+                tokens.push_back(s.substr(prev, pos - prev));
+                prev = pos + 1;
+            } while ((pos < s.length()) && (prev < s.length()));
+            return tokens;
+        }
+
+        void compile() {
+            for (std::string n_symbol: split(str, '+')) {
+                Term term;
+                term.coeff = 1;
+                if (n_symbol[0] == '-') {
+                    term.coeff = -1;
+                    n_symbol = n_symbol.substr(1);
+                }
+                for (const std::string& factor: split(n_symbol, '*')) {
+                    if (factor[0] >= '0' && factor[0] <= '9') {
+                        term.coeff *= std::stoi(factor);
+                    } else {
+                        assert(factor.size() == 1 && factor[0] >= 'a' && factor[0] <= 'z');
+                        term.vars.push_back(factor[0] - 'a');
+                    }
+                }
+                terms.push_back(term);
+            }
+        }
+
+    public:
+
         friend std::ostream& operator << (std::ostream& out, const Symbolic &s) {
             out << s.str;
             return out;
@@ -68,11 +142,22 @@ public:
             return value;
         }
 
-        Symbolic extract_symbol(void) const {
+        const Symbolic& extract_symbol(void) const {
             assert(is_symbolic());
             return symbolic;
         }
 
+        bool same_as(const MaybeSymbolic& other) const {
+            if (_is_symbolic != other._is_symbolic) {
+                return false;
+            }
+            return _is_symbolic ? (symbolic.str == other.symbolic.str) : (value == other.value);
+        }
+
+        size_t hash() const {
+            return _is_symbolic ? std::hash<std::string>()(symbolic.str) : std::hash<int>()(value);
+        }
+
         friend std::ostream& operator << (std::ostream& out, const MaybeSymbolic &s) {
             if (s.is_symbolic()) {
                 out << s.extract_symbol();
@@ -96,11 +181,59 @@ public:
 protected:
     enum FormulaType { FORM_ONE, FORM_LEAF, FORM_LFUNC, FORM_POWER, FORM_PRODUCT };
     FormulaType formula_type = FORM_ONE;
-    LeafType leaf_type;
+    LeafType leaf_type = LEAF_UNKNOWN;
     LeafExtraArg leaf_extra;
+    int leaf_compose = 1; /* The leaf is n -> f(n^leaf_compose) */
     MaybeSymbolic power = MaybeSymbolic(0);
     MaybeSymbolic exponent = MaybeSymbolic(0);
     std::vector<HFormula> sub_formula;
+    size_t structural_hash = 0; /* Set when interned */
+
+    friend class HFormula;
+
+    /* Only looks at the fields used by the formula type; sub-formulas are interned already */
+    size_t computeHash() const {
+        size_t h = formula_type;
+        auto mix = [&h](size_t value) {
+            h ^= value + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        };
+        switch (formula_type) {
+            case FORM_LEAF:
+                mix(leaf_type);
+                mix(leaf_extra.k.hash());
+                mix(leaf_extra.l.hash());
+                mix(leaf_compose);
+                break;
+            case FORM_LFUNC:
+                mix(exponent.hash());
+                break;
+            case FORM_POWER:
+                mix(power.hash());
+                break;
+            default:
+                break;
+        }
+        for (const auto& sub : sub_formula) {
+            mix(sub.hash());
+        }
+        return h;
+    }
+    bool sameStructure(const Node& other) const {
+        if (formula_type != other.formula_type || sub_formula != other.sub_formula) {
+            return false;
+        }
+        switch (formula_type) {
+            case FORM_LEAF:
+                return leaf_type == other.leaf_type && leaf_compose == other.leaf_compose
+                    && leaf_extra.k.same_as(other.leaf_extra.k) && leaf_extra.l.same_as(other.leaf_extra.l);
+            case FORM_LFUNC:
+                return exponent.same_as(other.exponent);
+            case FORM_POWER:
+                return power.same_as(other.power);
+            default:
+                return true;
+        }
+    }
 
     std::string textify(LeafType in, bool latex) const {
         std::string ret;
@@ -241,6 +374,9 @@ protected:
                 break;
             case FORM_LEAF:
                 out << textify(leaf_type, latex);
+                if (leaf_compose != 1) {
+                    out << (latex ? "(n^{" : "(n^") << std::to_string(leaf_compose) << (latex ? "})" : ")");
+                }
                 break;
             case FORM_LFUNC: {
                 const Node* sub_func = sub_formula[0].get();
@@ -387,12 +523,12 @@ public:
         return power.extract_value();
     }
 
-    MaybeSymbolic getPowerS() const {
+    const MaybeSymbolic& getPowerS() const {
         assert(isPower());
         return power;
     }
 
-    HFormula getPowerInner() const {
+    const HFormula& getPowerInner() const {
         assert(isPower());
         return sub_formula[0];
     }
@@ -402,7 +538,7 @@ public:
         return sub_formula.size();
     }
 
-    HFormula getProductElem(size_t idx) const {
+    const HFormula& getProductElem(size_t idx) const {
         assert(isProduct() && (idx < sub_formula.size()));
         return sub_formula[idx];
     }
@@ -411,12 +547,12 @@ public:
         return formula_type == FORM_LFUNC;
     }
 
-    HFormula getLFuncProduct() const {
+    const HFormula& getLFuncProduct() const {
         assert(isLFunc() && sub_formula[0].get()->isProduct());
         return sub_formula[0];
     }
 
-    MaybeSymbolic getLFuncExponentS() const {
+    const MaybeSymbolic& getLFuncExponentS() const {
         assert(isLFunc());
         return exponent;
     }
@@ -433,7 +569,7 @@ public:
         return isLFunc() && !isZeta();
     }
 
-    MaybeSymbolic getZetaExponentS() const {
+    const MaybeSymbolic& getZetaExponentS() const {
         assert(isZeta());
         return getLFuncExponentS();
     }
@@ -442,12 +578,29 @@ public:
         return getZetaExponentS().extract_value();
     }
 
+    LeafType getLeafType(void) const {
+        assert(isPower() || isLeaf());
+        if (isPower()) {
+            return sub_formula[0].get()->getLeafType();
+        }
+        return leaf_type;
+    }
+
     bool isLeafSameAs(const Node* other) const {
         assert(isLeaf());
         assert(other->isLeaf());
         return leaf_type == other->leaf_type;
     }
 
+    int getLeafCompose(void) const {
+        if (isPower()) {
+            assert(sub_formula[0].get()->isLeaf());
+            return sub_formula[0].get()->getLeafCompose();
+        }
+        assert(isLeaf());
+        return leaf_compose;
+    }
+
     bool isMu() const {
         return isLeafOfType(LEAF_MU);
     }
@@ -490,12 +643,12 @@ public:
         return leaf_extra.l.extract_value();
     }
 
-    MaybeSymbolic getLeafKS_dangerous() const {
+    const MaybeSymbolic& getLeafKS_dangerous() const {
         assert(isLeaf());
         return leaf_extra.k;
     }
 
-    MaybeSymbolic getLeafLS_dangerous() const {
+    const MaybeSymbolic& getLeafLS_dangerous() const {
         assert(isLeaf());
         return leaf_extra.l;
     }
@@ -503,6 +656,32 @@ public:
     std::vector<HFormula> getSubFormula() const {
         return sub_formula;
     }
+    /* Flat encoding, for checkpoints: the type, its fields, then its sub-formulas. Not for symbolic formulas */
+    void serialize(std::vector<uint32_t>& out) const {
+        out.push_back(formula_type);
+        switch (formula_type) {
+            case FORM_ONE:
+                break;
+            case FORM_LEAF:
+                out.push_back(leaf_type);
+                out.push_back(leaf_extra.k.extract_value());
+                out.push_back(leaf_extra.l.extract_value());
+                out.push_back(leaf_compose);
+                break;
+            case FORM_LFUNC:
+                out.push_back(exponent.extract_value());
+                break;
+            case FORM_POWER:
+                out.push_back(power.extract_value());
+                break;
+            case FORM_PRODUCT:
+                out.push_back(sub_formula.size());
+                break;
+        }
+        for (const auto& sub : sub_formula) {
+            sub.get()->serialize(out);
+        }
+    }
 };
 
 class NodeOne : public HFormula::Node
@@ -517,7 +696,7 @@ class HFormulaOne : public HFormula
 {
 public:
     HFormulaOne() {
-        formula = std::make_shared<const Node>(NodeOne());
+        formula = intern(NodeOne());
     }
 };
 
@@ -542,17 +721,26 @@ public:
         leaf_type = type;
         leaf_extra = extra;
     }
+
+    NodeLeaf(LeafType type, LeafExtraArg extra, int compose) : NodeLeaf(type, extra) {
+        assert(compose >= 1);
+        leaf_compose = compose;
+    }
 };
 
 class HFormulaLeaf : public HFormula
 {
 public:
     HFormulaLeaf(Node::LeafType type) {
-        formula = std::make_shared<const Node>(NodeLeaf(type));
+        formula = intern(NodeLeaf(type));
     }
 
     HFormulaLeaf(Node::LeafType type, Node::LeafExtraArg extra) {
-        formula = std::make_shared<const Node>(NodeLeaf(type, extra));
+        formula = intern(NodeLeaf(type, extra));
+    }
+
+    HFormulaLeaf(Node::LeafType type, Node::LeafExtraArg extra, int compose) {
+        formula = intern(NodeLeaf(type, extra, compose));
     }
 };
 
@@ -575,11 +763,11 @@ class HFormulaLFunction : public HFormula
 {
 public:
     HFormulaLFunction(const HFormula& sub_func, int sub_exponent) {
-        formula = std::make_shared<const Node>(NodeLFunction(sub_func, sub_exponent));
+        formula = intern(NodeLFunction(sub_func, sub_exponent));
     }
 
     HFormulaLFunction(const HFormula& sub_func, Node::Symbolic sub_exponent) {
-        formula = std::make_shared<const Node>(NodeLFunction(sub_func, sub_exponent));
+        formula = intern(NodeLFunction(sub_func, sub_exponent));
     }
 };
 
@@ -601,7 +789,7 @@ class HFormulaPower : public HFormula
 {
 public:
     HFormulaPower(const HFormula& part, int power) {
-        formula = std::make_shared<const Node>(NodePower(part, power));
+        formula = intern(NodePower(part, power));
     }
 };
 
@@ -658,18 +846,136 @@ class HFormulaProduct : public HFormula
 {
 public:
     HFormulaProduct(const HFormula& unique) {
-        formula = std::make_shared<const Node>(NodeProduct(unique));
+        formula = intern(NodeProduct(unique));
     }
 
     HFormulaProduct(const HFormula& left, const HFormula& right) {
-        formula = std::make_shared<const Node>(NodeProduct(left, right));
+        formula = intern(NodeProduct(left, right));
     }
 
     HFormulaProduct(const HFormula& a, const HFormula& b, const HFormula& c) {
-        formula = std::make_shared<const Node>(NodeProduct(a, b, c));
+        formula = intern(NodeProduct(a, b, c));
     }
 };
 
+class NodeSerialized : public HFormula::Node
+{
+private:
+    /* Past the end, clears `valid` and reads zeros */
+    static int next(const uint32_t*& in, const uint32_t* end, bool& valid) {
+        if (in == end) {
+            valid = false;
+            return 0;
+        }
+        return (int)*in++;
+    }
+public:
+    /* Reads what Node::serialize() wrote, and moves `in` past it; clears `valid` if it is not */
+    NodeSerialized(const uint32_t*& in, const uint32_t* end, bool& valid);
+};
+class HFormulaSerialized : public HFormula
+{
+public:
+    HFormulaSerialized(const uint32_t*& in, const uint32_t* end, bool& valid) {
+        formula = intern(NodeSerialized(in, end, valid));
+    }
+};
+
+NodeSerialized::NodeSerialized(const uint32_t*& in, const uint32_t* end, bool& valid) {
+    formula_type = (FormulaType)next(in, end, valid);
+    size_t nb_sub = 0;
+    switch (formula_type) {
+        case FORM_ONE:
+            break;
+        case FORM_LEAF:
+            leaf_type = (LeafType)next(in, end, valid);
+            leaf_extra.k = next(in, end, valid);
+            leaf_extra.l = next(in, end, valid);
+            leaf_compose = next(in, end, valid);
+            valid = valid && leaf_type < LEAF_UNKNOWN;
+            break;
+        case FORM_LFUNC:
+            exponent = next(in, end, valid);
+            nb_sub = 1;
+            break;
+        case FORM_POWER:
+            power = next(in, end, valid);
+            nb_sub = 1;
+            break;
+        case FORM_PRODUCT:
+            nb_sub = next(in, end, valid);
+            break;
+        default:
+            valid = false;
+    }
+    /* Each sub-formula takes a word at least */
+    valid = valid && nb_sub <= (size_t)(end - in);
+    for (size_t i = 0; i < nb_sub && valid; i++) {
+        sub_formula.push_back(HFormulaSerialized(in, end, valid));
+    }
+    /* What is interned then is only a placeholder, never a half-read formula */
+    if (!valid) {
+        formula_type = FORM_ONE;
+        sub_formula.clear();
+    }
+}
+
+std::shared_ptr<const HFormula::Node> HFormula::intern(const Node& node) {
+    /*
+     * Sharded by hash, so that the classification threads seldom wait for one
+     * another. Shards only hold weak references: a node is freed with its last
+     * formula, and its deleter takes it out of its shard. The shards are never
+     * destroyed, as formulas in static storage may outlive any static table.
+     */
+    static const size_t NB_SHARDS = 64;
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_multimap<size_t, std::pair<const Node*, std::weak_ptr<const Node>>> nodes;
+    };
+    static Shard* shards = new Shard[NB_SHARDS];
+    auto shard_of = [](size_t h) -> Shard& {
+        return shards[(h ^ (h >> 32)) % NB_SHARDS];
+    };
+
+    size_t h = node.computeHash();
+    Shard& shard = shard_of(h);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto range = shard.nodes.equal_range(h);
+    for (auto it = range.first; it != range.second; it++) {
+        /* Deleters erase under the lock before freeing, so the nodes listed are readable.
+           One may have expired, its deleter waiting for the lock: it cannot be reused */
+        if (it->second.first->sameStructure(node)) {
+            std::shared_ptr<const Node> existing = it->second.second.lock();
+            if (existing) {
+                return existing;
+            }
+        }
+    }
+    Node* created = new Node(node);
+    created->structural_hash = h;
+    std::shared_ptr<const Node> interned(created, [shard_of](const Node* dead) {
+        Shard& dead_shard = shard_of(dead->structural_hash);
+        {
+            std::lock_guard<std::mutex> dead_lock(dead_shard.mtx);
+            auto dead_range = dead_shard.nodes.equal_range(dead->structural_hash);
+            for (auto it = dead_range.first; it != dead_range.second; it++) {
+                if (it->second.first == dead) {
+                    dead_shard.nodes.erase(it);
+                    break;
+                }
+            }
+        }
+        /* Out of the lock: freeing the sub-formulas can come back to this shard */
+        delete dead;
+    });
+    shard.nodes.insert({h, {created, interned}});
+    return interned;
+}
+
+size_t HFormula::hash() const {
+    return formula->structural_hash;
+}
+
 std::ostream& operator << (std::ostream& out, const HFormula &h) {
     return h.get()->print_full(out, false);
 }
@@ -0,0 +1,149 @@
+#pragma once
+#include <cassert>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "matrix.h"
+#include "polynomial.h"
+using namespace std;
+
+/*
+ * Left kernel of a matrix whose rows arrive one at a time, kept in row
+ * echelon form: each row is reduced against the previous independent ones,
+ * and a row that reduces to zero yields the relation expressing it in terms
+ * of them. This is the same elimination as kernel_basis, so both find the
+ * same relations when rows are added in the same order.
+ *
+ * Columns may be split: a column becomes a combination of fresh columns, as
+ * happens when a coprime basis element is refined.
+ *
+ * A reduced row may take any of its columns as pivot. By default it is the
+ * lowest one, as in kernel_basis; `pivot_key` picks the column of least key
+ * instead, for callers whose column numbers do not say which columns are best
+ * eliminated first.
+ */
+class IncrementalKernel {
+public:
+   /* Adds the row of index `id`; returns its relation if it depends on the previous rows, an empty row otherwise */
+   MatrixRow<Rational> addRow(size_t id, MatrixRow<Rational> row);
+   /* Replaces column `col` by `expansion`, whose columns no row uses yet */
+   void splitColumn(size_t col, const vector<pair<size_t, int>>& expansion);
+
+   size_t nbRows() const;
+   size_t rank() const;
+
+   function<size_t(size_t)> pivot_key;
+private:
+   size_t nb_rows = 0;
+   vector<MatrixRow<Rational>> rows; /* Independent rows, reduced, with a leading 1 at their pivot */
+   vector<MatrixRow<Rational>> combinations; /* Each of them, over the original rows */
+   unordered_map<size_t, size_t> pivot_row; /* Pivot column -> row */
+   unordered_map<size_t, vector<size_t>> column_rows; /* Rows that may use a column */
+
+   void indexColumns(size_t iRow);
+};
+
+MatrixRow<Rational> IncrementalKernel::addRow(size_t id, MatrixRow<Rational> row) {
+   MatrixRow<Rational> combination(vector<pair<size_t, Rational>>{{id, Rational(1)}});
+   nb_rows++;
+
+   /* A row has no entry on the pivots of the rows before it, so eliminating
+      the earliest pivot first never brings back one already eliminated */
+   while(true) {
+      size_t first = rows.size();
+      Rational coeff(0);
+      for(auto& entry : row.coeffs) {
+         auto it = pivot_row.find(entry.first);
+         if(it != pivot_row.end() && it->second < first) {
+            first = it->second;
+            coeff = entry.second;
+         }
+      }
+      if(first == rows.size()) {
+         break;
+      }
+      row = row - coeff * rows[first];
+      combination = combination - coeff * combinations[first];
+   }
+
+   if(row.coeffs.empty()) {
+      return combination;
+   }
+
+   size_t col = row.coeffs[0].first;
+   Rational pivot = row.coeffs[0].second;
+   if(pivot_key) {
+      for(auto& entry : row.coeffs) {
+         if(pivot_key(entry.first) < pivot_key(col)) {
+            col = entry.first;
+            pivot = entry.second;
+         }
+      }
+   }
+   Rational inv = inverse(pivot);
+   row *= inv;
+   combination *= inv;
+
+   rows.push_back(row);
+   combinations.push_back(combination);
+   pivot_row[col] = rows.size() - 1;
+   indexColumns(rows.size() - 1);
+   return MatrixRow<Rational>(0);
+}
+
+void IncrementalKernel::splitColumn(size_t col, const vector<pair<size_t, int>>& expansion) {
+   auto users = column_rows.find(col);
+   if(users == column_rows.end()) {
+      return;
+   }
+
+   vector<pair<size_t, Rational>> pieces;
+   for(auto& piece : expansion) {
+      pieces.push_back({piece.first, Rational(piece.second)});
+   }
+   MatrixRow<Rational> expanded(pieces);
+   MatrixRow<Rational> unit(vector<pair<size_t, Rational>>{{col, Rational(1)}});
+
+   vector<size_t> iRows;
+   swap(iRows, users->second);
+   column_rows.erase(users);
+
+   for(size_t iRow : iRows) {
+      Rational coeff = rows[iRow].getCoeff(col);
+      if(is_zero(coeff)) {
+         continue;
+      }
+      rows[iRow] = rows[iRow] - coeff * unit + coeff * expanded;
+      indexColumns(iRow);
+   }
+
+   /* Rows after the pivot row have no entry on `col`, so none on its pieces:
+      any piece can take over as the pivot */
+   auto it = pivot_row.find(col);
+   if(it != pivot_row.end()) {
+      size_t iRow = it->second;
+      pivot_row.erase(it);
+      size_t new_pivot = expansion[0].first;
+      Rational inv = inverse(rows[iRow].getCoeff(new_pivot));
+      rows[iRow] *= inv;
+      combinations[iRow] *= inv;
+      pivot_row[new_pivot] = iRow;
+   }
+}
+
+void IncrementalKernel::indexColumns(size_t iRow) {
+   for(auto& entry : rows[iRow].coeffs) {
+      vector<size_t>& users = column_rows[entry.first];
+      if(users.empty() || users.back() != iRow) {
+         users.push_back(iRow);
+      }
+   }
+}
+
+size_t IncrementalKernel::nbRows() const {
+   return nb_rows;
+}
+
+size_t IncrementalKernel::rank() const {
+   return rows.size();
+}
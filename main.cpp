@@ -1,8 +1,10 @@
 constexpr int PRIME_MODULO = 997;
 
+#include <fstream>
 #include <iostream>
 #include "hformula.h"
 #include "generation.h"
+#include "metrics.h"
 #include "print.h"
 #include "relations.h"
 using namespace std;
@@ -11,7 +13,7 @@ using namespace std;
  * Edit me as you wish to change the generated L-functions
  */
 static constexpr GenerationConstraintLine generation_constraints_lines[] = {
-    /* leaf_type                  , min_exp, max_exp, [extra min/max k, [min/max l]] */
+    /* leaf_type                  , min_exp, max_exp, [extra min/max k, [min/max l]], [compose] */
     {FormulaNode::LEAF_LIOUVILLE  ,       0, 1,       {}},
     {FormulaNode::LEAF_TAUK       ,       0, 2,       {2, 2}},
     {FormulaNode::LEAF_THETA      ,       0, 1,       {}},
@@ -22,6 +24,7 @@ static constexpr GenerationConstraintLine generation_constraints_lines[] = {
     {FormulaNode::LEAF_NU         ,       0, 1,       {2, 2}},
     //{FormulaNode::LEAF_MU         ,       0, 2,       {1, 2}},
     //{FormulaNode::LEAF_ZETAK      ,       0, 1,       {1, 3}},
+    //{FormulaNode::LEAF_SIGMA      ,       0, 1,       {1, 2},       2}, /* σ_k(n^2) */
 };
 
 /*
@@ -39,29 +42,143 @@ int main([[maybe_unused]] int argc, [[maybe_unused]] char *argv[]) {
     precomputeInverses();
     X.setCoeff(1, 1);
     U.setCoeff(0, 1);
-    x = Fraction<Univariate>(X);
-    u = Fraction<Univariate>(U);
-    z = Fraction<Univariate>(Z);
+    x = FArithScalar(X);
+    u = FArithScalar(U);
+    z = FArithScalar(Z);
     Latex latex;
 
-    auto t1 = std::chrono::high_resolution_clock::now();
+    char* lazy_threshold_string = getenv("FRACTION_LAZY_THRESHOLD");
+    if (lazy_threshold_string != NULL) {
+        Fraction<Univariate>::lazy_threshold = stoi(string(lazy_threshold_string));
+    }
+
+    /*
+     * GEN_MAX_SUM / GEN_MAX_SCORE / GEN_LEAVES=<leaf,...>: override the
+     * constraints above without rebuilding, e.g. for bench/scaling.py
+     */
+    GenerationConstraint constraints = generation_constraints;
+    char* gen_max_sum_string = getenv("GEN_MAX_SUM");
+    if (gen_max_sum_string != NULL) {
+        constraints.max_sum = stoi(string(gen_max_sum_string));
+    }
+    char* gen_max_score_string = getenv("GEN_MAX_SCORE");
+    if (gen_max_score_string != NULL) {
+        constraints.max_score = stoi(string(gen_max_score_string));
+    }
+    vector<GenerationConstraintLine> enabled_lines;
+    char* gen_leaves_string = getenv("GEN_LEAVES");
+    if (gen_leaves_string != NULL) {
+        if (!filter_generation_lines(generation_constraints.lines, generation_constraints.lines_count,
+                                     gen_leaves_string, enabled_lines)) {
+            cerr << "GEN_LEAVES: unknown leaf in " << gen_leaves_string << endl;
+            return 1;
+        }
+        constraints.lines = enabled_lines.data();
+        constraints.lines_count = enabled_lines.size();
+    }
+
+    /* FRACTION_CACHE=<path>: get_fraction() results kept across runs */
+    FractionCache fraction_cache;
+    char* fraction_cache_string = getenv("FRACTION_CACHE");
+    if (fraction_cache_string != NULL) {
+        fraction_cache.open(fraction_cache_string);
+    }
+
     RelationGenerator manager(&latex);
-    add_relations(manager, latex, generation_constraints);
+    if (manager.usesCheckpoints() && manager.isPipelined()) {
+        cerr << "CHECKPOINT_SAVE and CHECKPOINT_LOAD do not support PIPELINE" << endl;
+        return 1;
+    }
+    manager.setCheckpointConfiguration(checkpoint_configuration(constraints, manager.isPipelined()));
+
+    MetricTimer checkpoint_timer(METRIC_CHECKPOINT_LOAD);
+    CheckpointStage resumed = manager.loadCheckpoint();
+    float checkpoint_seconds = checkpoint_timer.stop();
+    if (resumed >= CHECKPOINT_FRACTIONS) {
+        cerr << "Checkpoint loaded ("<< manager.names.size() << " fractions, stage " << resumed << ")"
+             << KGRY << " (" << checkpoint_seconds << "s)" KRST << endl;
+    } else {
+        MetricTimer generation_timer(METRIC_GENERATION);
+        if (manager.isPipelined()) {
+            manager.startPipeline();
+        }
+        add_relations(manager, latex, fraction_cache, constraints);
+        float generation_seconds = generation_timer.stop();
 
-    auto t2 = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<float> e21 = t2 - t1;
-    cout.flush();
-    cerr << "Data generated ("<< manager.rational_fractions.size() << " fractions)"
-         << KGRY << " (" << e21.count() << "s)" KRST << endl;
+        cout.flush();
+        cerr << "Data generated ("<< manager.names.size() << " fractions)"
+             << KGRY << " (" << generation_seconds << "s)" KRST << endl;
+        if (fraction_cache.enabled()) {
+            cerr << KGRY "Fraction cache: " << fraction_cache.nbHits() << " hits, "
+                 << fraction_cache.nbMisses() << " misses" KRST << endl;
+        }
+        manager.saveCheckpoint(CHECKPOINT_FRACTIONS);
+    }
+    if (Fraction<Univariate>::lazy_threshold != 0) {
+        cerr << KGRY "Lazy fractions: " << Fraction<Univariate>::nb_gcd_computed << " gcds computed, "
+             << Fraction<Univariate>::nb_gcd_avoided << " avoided" KRST << endl;
+    }
 
-    auto t3 = std::chrono::high_resolution_clock::now();
-    manager.prepareBasis();
-    auto t4 = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<float> e43 = t4 - t3;
-    cerr << "Basis prepared ("<< manager.polynomial_basis.size() << " polynomials)"
-         << KGRY << " (" << e43.count() << "s)" KRST << endl;
+    if (resumed < CHECKPOINT_BASIS) {
+        MetricTimer basis_timer(METRIC_BASIS);
+        manager.prepareBasis();
+        float basis_seconds = basis_timer.stop();
+        cerr << "Basis prepared ("<< manager.polynomial_basis.size() << " polynomials)"
+             << KGRY << " (" << basis_seconds << "s)" KRST << endl;
+        manager.saveCheckpoint(CHECKPOINT_BASIS);
+    }
 
     manager.printRelations();
 
+    /*
+     * EXTEND_MAX_SUM / EXTEND_MAX_SCORE: then raise the limits and only print
+     * the relations involving the new fractions
+     */
+    GenerationConstraint extended_constraints = constraints;
+    char* extend_sum_string = getenv("EXTEND_MAX_SUM");
+    char* extend_score_string = getenv("EXTEND_MAX_SCORE");
+    if (extend_sum_string != NULL) {
+        extended_constraints.max_sum = stoi(string(extend_sum_string));
+    }
+    if (extend_score_string != NULL) {
+        extended_constraints.max_score = stoi(string(extend_score_string));
+    }
+    if (extend_sum_string != NULL || extend_score_string != NULL) {
+        size_t nb_known = manager.names.size();
+        MetricTimer generation_timer(METRIC_GENERATION);
+        if (manager.isPipelined()) {
+            manager.startPipeline();
+        }
+        add_relations(manager, latex, fraction_cache, extended_constraints);
+        float generation_seconds = generation_timer.stop();
+        MetricTimer basis_timer(METRIC_BASIS);
+        manager.extendBasis();
+        float basis_seconds = basis_timer.stop();
+        cout.flush();
+        cerr << "Extended data generated (" << manager.names.size() - nb_known << " new fractions, "
+             << manager.polynomial_basis.size() << " polynomials)"
+             << KGRY << " (" << generation_seconds + basis_seconds << "s)" KRST << endl;
+
+        manager.printRelations();
+    }
+
+    /* METRICS_JSON=<path> / METRICS_CSV=<path>: phase timers and counters of the whole run */
+    char* metrics_json_string = getenv("METRICS_JSON");
+    if (metrics_json_string != NULL) {
+        ofstream json(metrics_json_string);
+        Metrics::printJson(json);
+        if (!json) {
+            cerr << KRED "Cannot write " << metrics_json_string << KRST << endl;
+        }
+    }
+    char* metrics_csv_string = getenv("METRICS_CSV");
+    if (metrics_csv_string != NULL) {
+        ofstream csv(metrics_csv_string);
+        Metrics::printCsv(csv);
+        if (!csv) {
+            cerr << KRED "Cannot write " << metrics_csv_string << KRST << endl;
+        }
+    }
+
     return 0;
 }
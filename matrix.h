@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <cassert>
 #include <iomanip>
 #include <vector>
@@ -103,17 +104,26 @@ T MatrixRow<T>::getCoeff(size_t num_col) const {
    return T(0);
 }
 
+/* Writes the Kronecker product of `a` and `b` into `result`, already sorted */
 template<typename T>
-MatrixRow<T> tensor(const MatrixRow<T>& a, const MatrixRow<T>& b, size_t n) {
-   vector<pair<size_t, T>> result;
+void tensor_into(const MatrixRow<T>& a, const MatrixRow<T>& b, size_t n, MatrixRow<T>& result) {
+   result.coeffs.clear();
+   result.coeffs.reserve(a.coeffs.size() * b.coeffs.size());
    for (auto& coeffA: a.coeffs) {
-      if (!is_zero(coeffA.second)) {
-         for (auto& coeffB: b.coeffs) {
-            result.push_back(make_pair(coeffA.first * n + coeffB.first, coeffA.second * coeffB.second));
+      for (auto& coeffB: b.coeffs) {
+         T value = coeffA.second * coeffB.second;
+         if (!is_zero(value)) {
+            result.coeffs.emplace_back(coeffA.first * n + coeffB.first, value);
          }
       }
    }
-   return MatrixRow<T>(result);
+}
+
+template<typename T>
+MatrixRow<T> tensor(const MatrixRow<T>& a, const MatrixRow<T>& b, size_t n) {
+   MatrixRow<T> result(0);
+   tensor_into(a, b, n, result);
+   return result;
 }
 
 template<typename T>
@@ -376,20 +386,73 @@ inline T single_product_element(const Matrix<T>& a, const Matrix<T>& b, size_t i
    return res;
 }
 
+/*
+ * Row by row, through an accumulator indexed by column. Only the touched
+ * columns are sorted, unless the row fills up, in which case it is scanned.
+ * That scan is the dense case: there is no separate dense product, since
+ * products of zero entries would still have to be skipped, and with fraction
+ * entries their cost dwarfs the indexing.
+ */
 template<typename T>
 Matrix<T> operator * (const Matrix<T>& a, const Matrix<T>& b) {
    Matrix<T> res(a.nbRows(), b.nbCols());
 
+   vector<T> accumulator(b.nbCols(), T(0));
+   vector<bool> is_touched(b.nbCols(), false);
+   vector<size_t> touched;
+
    for (size_t iRow = 0; iRow < a.nbRows(); iRow++) {
-      for (size_t iCol = 0; iCol < b.nbCols(); iCol++) {
-         T elem = single_product_element(a, b, iRow, iCol);
-         res.coeffs[iRow].setCoeff(iCol, elem);
+      for (auto& coordA: a.coeffs[iRow].coeffs) {
+         for (auto& coordB: b.coeffs[coordA.first].coeffs) {
+            if (!is_touched[coordB.first]) {
+               is_touched[coordB.first] = true;
+               touched.push_back(coordB.first);
+            }
+            accumulator[coordB.first] += coordA.second * coordB.second;
+         }
       }
+
+      if (2 * touched.size() > b.nbCols()) {
+         touched.clear();
+         for (size_t iCol = 0; iCol < b.nbCols(); iCol++) {
+            if (is_touched[iCol]) {
+               touched.push_back(iCol);
+            }
+         }
+      } else {
+         sort(touched.begin(), touched.end());
+      }
+
+      auto& row = res.coeffs[iRow].coeffs;
+      row.reserve(touched.size());
+      for (size_t iCol : touched) {
+         if (!is_zero(accumulator[iCol])) {
+            row.emplace_back(iCol, accumulator[iCol]);
+         }
+         accumulator[iCol] = T(0);
+         is_touched[iCol] = false;
+      }
+      touched.clear();
    }
 
    return res;
 }
 
+/* Exponentiation by squaring */
+template<typename T>
+Matrix<T> pow(const Matrix<T>& a, size_t exp) {
+   assert(a.nbRows() == a.nbCols());
+   if (exp == 0) {
+      return identity<T>(a.nbRows());
+   }
+   Matrix<T> res = pow(a, exp / 2);
+   res = res * res;
+   if (exp % 2 != 0) {
+      res = res * a;
+   }
+   return res;
+}
+
 template<typename T>
 Matrix<T> transpose(Matrix<T> mat) {
    Matrix<T> res(mat.nbCols(), mat.nbRows());
@@ -402,11 +465,11 @@ Matrix<T> transpose(Matrix<T> mat) {
 }
 
 template<typename T>
-Matrix<T> tensor(Matrix<T> a, Matrix<T> b) {
+Matrix<T> tensor(const Matrix<T>& a, const Matrix<T>& b) {
    Matrix<T> res(a.nbRows() * b.nbRows(), a.nbCols() * b.nbCols());
    for (size_t aRow = 0; aRow < a.nbRows(); aRow++) {
       for (size_t bRow = 0; bRow < b.nbRows(); bRow++) {
-         res.coeffs[aRow * b.nbRows() + bRow] = tensor(a.coeffs[aRow], b.coeffs[bRow], b.nbCols());
+         tensor_into(a.coeffs[aRow], b.coeffs[bRow], b.nbCols(), res.coeffs[aRow * b.nbRows() + bRow]);
       }
    }
    return res;
@@ -429,16 +492,24 @@ std::ostream& operator << (std::ostream& out,const Matrix<T>& mat) {
 template<typename T>
 Matrix<T> magic_op(const Matrix<T>& a, const Matrix<T>& b) {
    Matrix<T> result(a.nbRows() + b.nbRows(), a.nbCols() + b.nbCols());
+   /* Column a.nbCols() is past every entry of `a`, so it is appended last */
    for (size_t iRow = 0; iRow < a.nbRows(); iRow++) {
-      result.coeffs[iRow] = a.coeffs[iRow];
+      const auto& row = a.coeffs[iRow].coeffs;
+      auto& out = result.coeffs[iRow].coeffs;
+      bool has_first = !row.empty() && row[0].first == 0;
+      out.reserve(row.size() + (has_first ? 1 : 0));
+      out.insert(out.end(), row.begin(), row.end());
+      if (has_first) {
+         out.emplace_back(a.nbCols(), -row[0].second);
+      }
    }
 
    for (size_t iRow = 0; iRow < b.nbRows(); iRow++) {
-      result.coeffs[iRow + a.nbRows()] = b.coeffs[iRow] << a.nbCols();
-   }
-
-   for (size_t iRow = 0; iRow < a.nbRows(); iRow++) {
-      result.coeffs[iRow].setCoeff(a.nbCols(), -a.coeffs[iRow].getCoeff(0));
+      auto& out = result.coeffs[iRow + a.nbRows()].coeffs;
+      out.reserve(b.coeffs[iRow].coeffs.size());
+      for (auto& coeff : b.coeffs[iRow].coeffs) {
+         out.emplace_back(coeff.first + a.nbCols(), coeff.second);
+      }
    }
 
    result.coeffs[0] = result.coeffs[0] + result.coeffs[a.nbRows()];
@@ -0,0 +1,158 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+using namespace std;
+
+/*
+ * Timers and counters of the pipeline phases. Each thread adds into its own
+ * block, so the hot paths never share a cache line; the blocks are summed
+ * when the report is written. Times of a phase run by several threads are
+ * summed over the threads, so they can exceed the wall-clock time.
+ */
+enum Metric {
+   METRIC_CHECKPOINT_LOAD,
+   METRIC_GENERATION,           /* add_relations(), from the first formula to the last */
+   METRIC_FRACTION,             /* Product and get_fraction() of one formula */
+   METRIC_FRACTION_INVERSE,     /* inverse(id - A) in get_fraction() */
+   METRIC_FRACTION_SIMPLIFY,    /* Product by u and normalization in get_fraction() */
+   METRIC_BASIS,
+   METRIC_DECOMPOSE,
+   METRIC_KERNEL,
+   METRIC_PIPELINE_BASIS,       /* Refinement of the coprime basis by one fraction */
+   METRIC_PIPELINE_KERNEL,      /* Reduction of the row of one fraction */
+   METRIC_CLASSIFY,             /* Classification and sort of the relations */
+   METRIC_CLASSIFY_RELATION,    /* Relation::classify() of one relation */
+   NB_METRICS,
+};
+
+constexpr const char* METRIC_NAMES[NB_METRICS] = {
+   "checkpoint.load",
+   "generation",
+   "fraction",
+   "fraction.inverse",
+   "fraction.simplify",
+   "basis",
+   "decompose",
+   "kernel",
+   "pipeline.basis",
+   "pipeline.kernel",
+   "classify",
+   "classify.relation",
+};
+
+class Metrics {
+public:
+   /* Adds `count` events taking `nanoseconds` in total to the block of this thread */
+   static void add(Metric metric, uint64_t count, uint64_t nanoseconds = 0);
+
+   static uint64_t count(Metric metric);
+   static uint64_t nanoseconds(Metric metric);
+
+   static void printJson(ostream& out);
+   static void printCsv(ostream& out);
+private:
+   struct Block {
+      /* Only written by the owning thread, so the adds need no atomic read-modify-write */
+      atomic<uint64_t> counts[NB_METRICS] = {};
+      atomic<uint64_t> nanoseconds[NB_METRICS] = {};
+   };
+
+   /* Blocks outlive their threads, so that the report sees all of them */
+   static mutex& registryMutex();
+   static vector<unique_ptr<Block>>& registry();
+   static Block& localBlock();
+};
+
+mutex& Metrics::registryMutex() {
+   static mutex mtx;
+   return mtx;
+}
+
+vector<unique_ptr<Metrics::Block>>& Metrics::registry() {
+   static vector<unique_ptr<Block>> blocks;
+   return blocks;
+}
+
+Metrics::Block& Metrics::localBlock() {
+   thread_local Block* block = NULL;
+   if(block == NULL) {
+      lock_guard<mutex> lock(registryMutex());
+      registry().push_back(make_unique<Block>());
+      block = registry().back().get();
+   }
+   return *block;
+}
+
+void Metrics::add(Metric metric, uint64_t count, uint64_t nanoseconds) {
+   Block& block = localBlock();
+   block.counts[metric].store(block.counts[metric].load(memory_order_relaxed) + count, memory_order_relaxed);
+   block.nanoseconds[metric].store(block.nanoseconds[metric].load(memory_order_relaxed) + nanoseconds, memory_order_relaxed);
+}
+
+uint64_t Metrics::count(Metric metric) {
+   lock_guard<mutex> lock(registryMutex());
+   uint64_t total = 0;
+   for(auto& block : registry()) {
+      total += block->counts[metric].load(memory_order_relaxed);
+   }
+   return total;
+}
+
+uint64_t Metrics::nanoseconds(Metric metric) {
+   lock_guard<mutex> lock(registryMutex());
+   uint64_t total = 0;
+   for(auto& block : registry()) {
+      total += block->nanoseconds[metric].load(memory_order_relaxed);
+   }
+   return total;
+}
+
+void Metrics::printJson(ostream& out) {
+   out << "{\"metrics\": [";
+   for(size_t iMetric = 0;iMetric < NB_METRICS;iMetric++) {
+      Metric metric = (Metric)iMetric;
+      out << (iMetric ? ",\n  " : "\n  ")
+          << "{\"name\": \"" << METRIC_NAMES[iMetric] << "\", \"count\": " << count(metric)
+          << ", \"total_s\": " << nanoseconds(metric) * 1e-9 << "}";
+   }
+   out << "\n]}" << endl;
+}
+
+void Metrics::printCsv(ostream& out) {
+   out << "name,count,total_s" << endl;
+   for(size_t iMetric = 0;iMetric < NB_METRICS;iMetric++) {
+      Metric metric = (Metric)iMetric;
+      out << METRIC_NAMES[iMetric] << "," << count(metric) << "," << nanoseconds(metric) * 1e-9 << endl;
+   }
+}
+
+/* Times a scope, or up to stop(), and counts it as one event */
+class MetricTimer {
+public:
+   MetricTimer(Metric _metric) : metric(_metric), start(chrono::steady_clock::now()) {}
+   ~MetricTimer() {
+      stop();
+   }
+   MetricTimer(const MetricTimer&) = delete;
+   MetricTimer& operator=(const MetricTimer&) = delete;
+
+   /* Records the event once; returns its duration in seconds */
+   float stop() {
+      if(!stopped) {
+         elapsed = chrono::steady_clock::now() - start;
+         Metrics::add(metric, 1, chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+         stopped = true;
+      }
+      return chrono::duration<float>(elapsed).count();
+   }
+private:
+   Metric metric;
+   chrono::steady_clock::time_point start;
+   chrono::steady_clock::duration elapsed = chrono::steady_clock::duration::zero();
+   bool stopped = false;
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/*
+ * Sorts [begin, end) with up to `nb_threads` threads: each thread sorts one
+ * chunk, then neighbouring chunks are merged pairwise, also in parallel.
+ * The result is the same as std::sort with the same strict weak ordering,
+ * up to the order of equivalent elements.
+ */
+template<typename Iterator, typename Compare>
+void parallel_sort(Iterator begin, Iterator end, Compare comp, size_t nb_threads) {
+   size_t size = end - begin;
+   size_t nb_chunks = max<size_t>(1, min(nb_threads, size / 1024));
+   if (nb_chunks == 1) {
+      sort(begin, end, comp);
+      return;
+   }
+
+   vector<Iterator> bounds;
+   for (size_t iChunk = 0;iChunk <= nb_chunks;iChunk++) {
+      bounds.push_back(begin + (size * iChunk) / nb_chunks);
+   }
+
+   vector<thread> threads;
+   for (size_t iChunk = 0;iChunk < nb_chunks;iChunk++) {
+      threads.emplace_back([&bounds, &comp, iChunk]() {
+         sort(bounds[iChunk], bounds[iChunk + 1], comp);
+      });
+   }
+   for (auto& thread_i : threads) {
+      thread_i.join();
+   }
+
+   while (bounds.size() > 2) {
+      vector<Iterator> merged_bounds;
+      threads.clear();
+      for (size_t iBound = 0;iBound + 2 < bounds.size();iBound += 2) {
+         Iterator first = bounds[iBound], middle = bounds[iBound + 1], last = bounds[iBound + 2];
+         threads.emplace_back([first, middle, last, &comp]() {
+            inplace_merge(first, middle, last, comp);
+         });
+         merged_bounds.push_back(first);
+      }
+      if (bounds.size() % 2 == 0) {
+         /* Odd number of chunks: the last one waits for the next round */
+         merged_bounds.push_back(bounds[bounds.size() - 2]);
+      }
+      merged_bounds.push_back(bounds.back());
+      for (auto& thread_i : threads) {
+         thread_i.join();
+      }
+      bounds = merged_bounds;
+   }
+}
+
+template<typename Iterator>
+void parallel_sort(Iterator begin, Iterator end, size_t nb_threads) {
+   parallel_sort(begin, end, [](const auto& a, const auto& b) { return a < b; }, nb_threads);
+}
+
+/*
+ * FIFO between pipeline stages: push() blocks while `capacity` items are
+ * waiting, pop() blocks until an item arrives or the queue is closed.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+   BoundedQueue(size_t _capacity) : capacity(_capacity) {}
+
+   void push(T item) {
+      unique_lock<mutex> lock(mtx);
+      not_full.wait(lock, [this]() { return items.size() < capacity; });
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+   }
+
+   /* False once the queue is closed and drained */
+   bool pop(T& item) {
+      unique_lock<mutex> lock(mtx);
+      not_empty.wait(lock, [this]() { return !items.empty() || closed; });
+      if (items.empty()) {
+         return false;
+      }
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return true;
+   }
+
+   void close() {
+      lock_guard<mutex> lock(mtx);
+      closed = true;
+      not_empty.notify_all();
+   }
+
+private:
+   size_t capacity;
+   bool closed = false;
+   deque<T> items;
+   mutex mtx;
+   condition_variable not_empty, not_full;
+};
@@ -51,7 +51,7 @@ inline bool operator > (const Polynomial<T>& a, const Polynomial<T>& b) {
 
 template<typename T>
 Polynomial<T>::Polynomial(vector<T> _coeffs) {
-	coeffs = _coeffs;
+	coeffs = move(_coeffs);
 	reduce();
 }
 
@@ -354,6 +354,12 @@ bool normalFactorCanReduce(const Polynomial<T>& a) {
 	return a.size() > 1;
 }
 
+/* Degree, as compared with Fraction::lazy_threshold; 0 for the zero polynomial */
+template<typename T>
+size_t normalDegree(const Polynomial<T>& a) {
+	return a.size() == 0 ? 0 : a.size() - 1;
+}
+
 template<typename T>
 Polynomial<T> compose(Polynomial<T> a, Polynomial<T> b) {
 	Polynomial<T> sum;
@@ -365,3 +371,13 @@ Polynomial<T> compose(Polynomial<T> a, Polynomial<T> b) {
 	sum.reduce();
 	return sum;
 }
+
+/* Horner's rule */
+template<typename T>
+T evaluate(const Polynomial<T>& a, const T& point) {
+	T value = T(0);
+	for (size_t iCoeff = a.size();iCoeff > 0;iCoeff--) {
+		value = value * point + a.getCoeff_unsafe(iCoeff - 1);
+	}
+	return value;
+}
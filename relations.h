@@ -1,17 +1,30 @@
 #pragma once
 #include <algorithm>
 #include <atomic>
-#include <chrono>
+#include <cstdint>
 #include <deque>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <random>
 #include <shared_mutex>
 #include <thread>
+#include <unordered_set>
+#include "checkpoint.h"
+#include "coprime_basis.h"
+#include "factored_fraction.h"
+#include "incremental_kernel.h"
 #include "matrix.h"
+#include "metrics.h"
+#include "parallel.h"
 #include "polynomial.h"
 #include "print.h"
 #include "xrelation.h"
 
+/* Entry of `kernel_columns` for a basis element that no reduced row uses yet */
+constexpr size_t NO_KERNEL_COLUMN = SIZE_MAX;
+
 class RelationGenerator {
 private:
    size_t nbThreads;
@@ -20,19 +33,117 @@ private:
 public:
    vector<HFormula> names;
    vector<Fraction<Univariate>> rational_fractions;
+   /* Empty unless the fraction was added in factored form */
+   vector<FactoredFraction::Factors> denominator_factors;
 
    vector<Univariate> polynomials;
    vector<Univariate> polynomial_basis;
+   /* Indices of `polynomial_basis` by the first polynomial they divide, the order decompose() tries */
+   vector<size_t> basis_trial_order;
 
    void addPolynomial(Univariate poly, int index = 0);
    void addFraction(HFormula& name, Fraction<Univariate> frac);
+   void addFraction(HFormula& name, const FactoredFraction& frac);
+   /* Whether a fraction of this name was already added, so that it can be skipped */
+   bool hasFraction(const HFormula& name) const;
 
    void printRelation(const vector<Rational>& relation, const vector<size_t>& iCol_in_rows);
    void printRelations();
 
    void prepareBasis(void);
+   /* Refines the basis with the polynomials added since, instead of starting over */
+   void extendBasis(void);
    void shuffleBasis(void);
 
+   bool isPipelined(void) const;
+   void startPipeline(void);
+
+   /* Checkpoints only load into a run of the same configuration, see checkpoint_configuration() */
+   void setCheckpointConfiguration(uint64_t configuration);
+   /* CHECKPOINT_LOAD=<path>: resumes after the stage saved there, which is returned */
+   CheckpointStage loadCheckpoint(void);
+   /* CHECKPOINT_SAVE=<path>: saves everything computed up to `stage` */
+   void saveCheckpoint(CheckpointStage stage, const Matrix<Rational>* decompositions = NULL);
+   bool usesCheckpoints(void) const;
+
+private:
+   /* Which entries of `denominatorFactors` are already in `polynomials` */
+   vector<bool> factor_added;
+   unordered_set<HFormula, HFormulaHash> known_names;
+
+   bool registerName(const HFormula& name);
+
+   /* Rows of the fractions from `first` on */
+   Matrix<Rational> decomposeFractions(size_t first);
+   /* Adds the rows to `kernel`; returns the relations they complete */
+   Matrix<Rational> reduceDecompositions(const Matrix<Rational>& decompositions);
+   void refineBasis(size_t first_polynomial);
+
+   /*
+    * Batch mode keeps the reduced relation matrix, so that fractions added
+    * later only cost their own rows. Its columns are numbered as the basis
+    * elements are first used, densest first within a batch, as prepare_matrix()
+    * orders them: the first batch runs the same elimination as kernel_basis().
+    */
+   IncrementalKernel kernel;
+   vector<size_t> kernel_columns; /* Per element of `polynomial_basis` */
+   size_t nb_kernel_columns = 0;
+   size_t nb_reduced_fractions = 0;
+   size_t nb_basis_polynomials = 0; /* Leading entries of `polynomials` already in the basis */
+   /* Columns of the elements split by extendBasis(), with their expansion over `polynomial_basis` */
+   vector<pair<size_t, MatrixRow<Rational>>> split_columns;
+
+   string checkpoint_save_path;
+   string checkpoint_load_path;
+   uint64_t checkpoint_configuration = 0;
+
+   /* CLASSIFY_STATS: per-classifier counters, printed after classification.
+      CLASSIFY_STATS_JSON=<path>: also written there, as JSON */
+   bool classify_stats = false;
+   string classify_stats_json_path;
+   /* Decompositions read from a checkpoint, if it went that far */
+   Matrix<Rational> loaded_decompositions = Matrix<Rational>(0, 0);
+   bool has_loaded_decompositions = false;
+
+   /*
+    * Pipelined mode: fractions go through a bounded queue to a thread that
+    * refines a coprime basis while generation continues. Each row is reduced
+    * against the previous ones as it arrives, so the relations are known once
+    * the queue is drained, and the pipeline can be started again to add more
+    * fractions at the cost of the new rows only.
+    *
+    * There is one producer, add_relations() on the main thread, and one
+    * consumer on purpose: each refinement of the coprime basis and each
+    * reduction depend on all the rows before them, so they cannot be sharded
+    * without merging bases and echelon forms afterwards. What overlaps is
+    * the generation of the next fractions with the basis refinement and the
+    * reduction of the previous ones; the queue of `pipeline_capacity` items
+    * blocks the producer when the consumer falls behind.
+    * No row is kept once reduced: memory is the echelon rows of
+    * `pipeline_kernel` (at most its rank) with their combinations, and the
+    * relations found since the last print.
+    */
+   struct PipelineItem {
+      Univariate numerator;
+      Univariate denominator; /* Unused when `denominator_factors` is not empty */
+      FactoredFraction::Factors denominator_factors;
+   };
+   size_t pipeline_capacity = 0;
+   unique_ptr<BoundedQueue<PipelineItem>> pipeline_queue;
+   thread pipeline_thread;
+   CoprimeBasis pipeline_basis;
+   map<size_t, CoprimeBasis::Factorization> pipeline_factor_rows;
+   /* Columns are the ids of `pipeline_basis` */
+   IncrementalKernel pipeline_kernel;
+   /* Found since the last printRelations() */
+   vector<MatrixRow<Rational>> pipeline_relations;
+
+   /* Kernel time of the pipeline up to the last printRelations() */
+   uint64_t pipeline_kernel_reported_ns = 0;
+
+   void pipelineWorker(void);
+
+public:
    RelationGenerator(Latex* _latex) {
       latex = _latex;
 
@@ -42,20 +153,292 @@ public:
       if(nbThreads_string != NULL) {
          nbThreads = stoi(string(nbThreads_string));
       }
+
+      /* PIPELINE=<queue capacity, in fractions> */
+      char* pipeline_string = getenv("PIPELINE");
+      if(pipeline_string != NULL) {
+         pipeline_capacity = stoi(string(pipeline_string));
+      }
+      /* Pivots on the elements of least degree, the factors most fractions share: in creation
+         order, the kernel took ten times more eliminations than batch mode's densest-first order */
+      pipeline_kernel.pivot_key = [this](size_t id) {
+         return pipeline_basis.element(id).size();
+      };
+
+      char* checkpoint_save_string = getenv("CHECKPOINT_SAVE");
+      if(checkpoint_save_string != NULL) {
+         checkpoint_save_path = checkpoint_save_string;
+      }
+      char* checkpoint_load_string = getenv("CHECKPOINT_LOAD");
+      if(checkpoint_load_string != NULL) {
+         checkpoint_load_path = checkpoint_load_string;
+      }
+
+      char* classify_stats_json_string = getenv("CLASSIFY_STATS_JSON");
+      if(classify_stats_json_string != NULL) {
+         classify_stats_json_path = classify_stats_json_string;
+      }
+      classify_stats = (getenv("CLASSIFY_STATS") != NULL) || !classify_stats_json_path.empty();
+      if(classify_stats) {
+         Relation::enable_classifier_stats();
+      }
    }
 };
 
+bool RelationGenerator::isPipelined(void) const {
+   return pipeline_capacity != 0;
+}
+
+void RelationGenerator::startPipeline(void) {
+   assert(isPipelined() && !pipeline_thread.joinable());
+   pipeline_queue = make_unique<BoundedQueue<PipelineItem>>(pipeline_capacity);
+   pipeline_thread = thread(&RelationGenerator::pipelineWorker, this);
+}
+
+void RelationGenerator::pipelineWorker(void) {
+   PipelineItem item;
+   while(pipeline_queue->pop(item)) {
+      MetricTimer basis_timer(METRIC_PIPELINE_BASIS);
+      CoprimeBasis::Factorization row = pipeline_basis.add(item.numerator);
+      if(item.denominator_factors.empty()) {
+         row = combine(row, 1, pipeline_basis.add(item.denominator), -1);
+      } else {
+         for(auto& factor : item.denominator_factors) {
+            auto it = pipeline_factor_rows.find(factor.first);
+            if(it == pipeline_factor_rows.end()) {
+               it = pipeline_factor_rows.insert({factor.first, pipeline_basis.add(denominatorFactors.get(factor.first))}).first;
+            }
+            row = combine(row, 1, it->second, -factor.second);
+         }
+      }
+      basis_timer.stop();
+
+      MetricTimer kernel_timer(METRIC_PIPELINE_KERNEL);
+      for(size_t id : pipeline_basis.takeSplitElements()) {
+         pipeline_kernel.splitColumn(id, pipeline_basis.expand(id));
+      }
+      vector<pair<size_t, Rational>> coeffs;
+      for(auto& factor : pipeline_basis.resolve(row)) {
+         coeffs.push_back({factor.first, Rational(factor.second)});
+      }
+      MatrixRow<Rational> relation = pipeline_kernel.addRow(pipeline_kernel.nbRows(), MatrixRow<Rational>(coeffs));
+      if(!relation.coeffs.empty()) {
+         pipeline_relations.push_back(relation);
+      }
+   }
+}
+
+bool RelationGenerator::usesCheckpoints(void) const {
+   return !checkpoint_save_path.empty() || !checkpoint_load_path.empty();
+}
+
+void RelationGenerator::setCheckpointConfiguration(uint64_t configuration) {
+   checkpoint_configuration = configuration;
+}
+
+CheckpointStage RelationGenerator::loadCheckpoint(void) {
+   if(checkpoint_load_path.empty()) {
+      return CHECKPOINT_NONE;
+   }
+   CheckpointReader reader(checkpoint_load_path, checkpoint_configuration);
+   if(!reader.error().empty()) {
+      cerr << KRED "Ignoring checkpoint " << checkpoint_load_path << ": " << reader.error() << KRST << endl;
+      return CHECKPOINT_NONE;
+   }
+   CheckpointStage stage = reader.stage();
+
+   size_t nb_names = reader.getCount();
+   names.reserve(nb_names);
+   for(size_t id = 0;id < nb_names;id++) {
+      names.push_back(reader.getFormula());
+      if(!registerName(names.back())) {
+         reader.fail("duplicate name");
+      }
+   }
+
+   size_t nb_fractions = reader.getCount(3);
+   if(nb_fractions != nb_names) {
+      reader.fail("not one fraction per name");
+   }
+   rational_fractions.reserve(nb_fractions);
+   for(size_t id = 0;id < nb_fractions;id++) {
+      Univariate numerator = reader.getPolynomial();
+      Univariate denominator = reader.getPolynomial();
+      uint32_t is_reduced = reader.getWord();
+      if(is_reduced > 1) {
+         reader.fail("bad fraction flag");
+      }
+      if(stage < CHECKPOINT_BASIS) {
+         polynomials.push_back(numerator);
+         polynomials.push_back(denominator);
+      }
+      if(is_reduced) {
+         rational_fractions.push_back(Fraction<Univariate>::fromReduced(numerator, denominator));
+      } else {
+         rational_fractions.push_back(Fraction<Univariate>(numerator, denominator, false));
+      }
+      denominator_factors.push_back(FactoredFraction::Factors());
+   }
+
+   if(stage >= CHECKPOINT_BASIS) {
+      /* A polynomial and its rank in the trial order each */
+      size_t nb_basis = reader.getCount(2);
+      polynomial_basis.reserve(nb_basis);
+      for(size_t iFactor = 0;iFactor < nb_basis;iFactor++) {
+         polynomial_basis.push_back(reader.getPolynomial());
+      }
+      vector<bool> seen(nb_basis, false);
+      basis_trial_order.reserve(nb_basis);
+      for(size_t iFactor = 0;iFactor < nb_basis;iFactor++) {
+         size_t iTrial = reader.getWord();
+         if(iTrial >= nb_basis || seen[iTrial]) {
+            reader.fail("trial order is not a permutation");
+            break;
+         }
+         seen[iTrial] = true;
+         basis_trial_order.push_back(iTrial);
+      }
+      kernel_columns.assign(nb_basis, NO_KERNEL_COLUMN);
+   }
+
+   if(stage >= CHECKPOINT_DECOMPOSITIONS) {
+      size_t nb_rows = reader.getCount();
+      size_t nb_cols = reader.getWord();
+      if(nb_rows != nb_fractions || nb_cols != polynomial_basis.size()) {
+         reader.fail("decompositions do not match the basis");
+      }
+      loaded_decompositions = Matrix<Rational>(0, nb_cols);
+      loaded_decompositions.coeffs.reserve(nb_rows);
+      for(size_t id = 0;id < nb_rows;id++) {
+         loaded_decompositions.coeffs.push_back(reader.getRow(nb_cols));
+      }
+      has_loaded_decompositions = true;
+   }
+   if(reader.error().empty() && reader.remaining() != 0) {
+      reader.fail("data after the last stage");
+   }
+
+   if(!reader.error().empty()) {
+      /* Nothing was there before: this run starts over */
+      cerr << KRED "Ignoring checkpoint " << checkpoint_load_path << ": " << reader.error() << KRST << endl;
+      names.clear();
+      known_names.clear();
+      rational_fractions.clear();
+      denominator_factors.clear();
+      polynomials.clear();
+      polynomial_basis.clear();
+      basis_trial_order.clear();
+      kernel_columns.clear();
+      loaded_decompositions = Matrix<Rational>(0, 0);
+      has_loaded_decompositions = false;
+      return CHECKPOINT_NONE;
+   }
+   return stage;
+}
+
+void RelationGenerator::saveCheckpoint(CheckpointStage stage, const Matrix<Rational>* decompositions) {
+   if(checkpoint_save_path.empty()) {
+      return;
+   }
+   CheckpointWriter writer;
+   writer.putWord(names.size());
+   for(auto& name : names) {
+      writer.putFormula(name);
+   }
+
+   writer.putWord(rational_fractions.size());
+   for(auto& frac : rational_fractions) {
+      writer.putPolynomial(frac.getNumerator());
+      writer.putPolynomial(frac.getDenominator());
+      writer.putWord(frac.isNormalized());
+   }
+
+   if(stage >= CHECKPOINT_BASIS) {
+      writer.putWord(polynomial_basis.size());
+      for(auto& poly : polynomial_basis) {
+         writer.putPolynomial(poly);
+      }
+      for(size_t iFactor : basis_trial_order) {
+         writer.putWord(iFactor);
+      }
+   }
+
+   if(stage >= CHECKPOINT_DECOMPOSITIONS) {
+      assert(decompositions != NULL);
+      writer.putWord(decompositions->nbRows());
+      writer.putWord(decompositions->nbCols());
+      for(auto& row : decompositions->coeffs) {
+         writer.putRow(row);
+      }
+   }
+
+   if(!writer.save(checkpoint_save_path, stage, checkpoint_configuration)) {
+      cerr << KRED "Could not save checkpoint " << checkpoint_save_path << KRST << endl;
+   }
+}
+
+bool RelationGenerator::registerName(const HFormula& name) {
+   return known_names.insert(name).second;
+}
+
+bool RelationGenerator::hasFraction(const HFormula& name) const {
+   return known_names.count(name) != 0;
+}
+
 void RelationGenerator::addFraction(HFormula& name, Fraction<Univariate> frac) {
+   if(!registerName(name)) {
+      return;
+   }
    names.push_back(name);
+   if(isPipelined()) {
+      pipeline_queue->push({frac.getNumerator(), frac.getDenominator(), FactoredFraction::Factors()});
+      return;
+   }
    rational_fractions.push_back(frac);
 
+   denominator_factors.push_back(FactoredFraction::Factors());
+
    polynomials.push_back(frac.getNumerator());
    polynomials.push_back(frac.getDenominator());
 }
 
-vector<pair<size_t, Rational>> decompose(Univariate poly, const vector<Univariate>& basis) {
+/*
+ * The denominator factors go to the basis instead of their product: they are
+ * smaller to refine, and each one is decomposed once for all fractions.
+ */
+void RelationGenerator::addFraction(HFormula& name, const FactoredFraction& frac) {
+   if(!registerName(name)) {
+      return;
+   }
+   names.push_back(name);
+   if(isPipelined()) {
+      pipeline_queue->push({frac.getNumerator(), Univariate(), frac.getDenominatorFactors()});
+      return;
+   }
+   /* Not reduced, so that the numerator matches the stored factors */
+   rational_fractions.push_back(Fraction<Univariate>(frac.getNumerator(), frac.getDenominator(), false));
+   denominator_factors.push_back(frac.getDenominatorFactors());
+
+   polynomials.push_back(frac.getNumerator());
+   for(auto& factor : frac.getDenominatorFactors()) {
+      if (factor.first >= factor_added.size()) {
+         factor_added.resize(factor.first + 1, false);
+      }
+      if (!factor_added[factor.first]) {
+         factor_added[factor.first] = true;
+         polynomials.push_back(denominatorFactors.get(factor.first));
+      }
+   }
+}
+
+/*
+ * Factors are tried in `trial_order`. The decomposition does not depend on it,
+ * but a good order makes `poly` constant early, which ends the divisions.
+ */
+vector<pair<size_t, Rational>> decompose(Univariate poly, const vector<Univariate>& basis,
+                                         const vector<size_t>& trial_order) {
    vector<pair<size_t, Rational>> decomposition;
-   for(size_t iFactor = 0;iFactor < basis.size();iFactor++) {
+   for(size_t iFactor : trial_order) {
       int nb = 0;
       while(poly.size() > 1 && isMultipleOf(poly, basis[iFactor])) {
          poly = poly / basis[iFactor];
@@ -69,14 +452,39 @@ vector<pair<size_t, Rational>> decompose(Univariate poly, const vector<Univariat
 
    assert(poly.size() <= 1);
 
+   sort(decomposition.begin(), decomposition.end(), [](const pair<size_t, Rational>& a, const pair<size_t, Rational>& b) {
+      return a.first < b.first;
+   });
    return decomposition;
 }
 
+/* A polynomial left to refine the basis with, from element `iElement` on */
+struct FactorisationItem {
+	size_t iElement;
+	size_t origin; /* Index in `polynomials` of a polynomial it divides */
+	Univariate poly;
+};
+
+/* Lowers `origin` to `value`; callers hold the basis lock at least shared */
+void lower_origin(atomic<size_t>& origin, size_t value) {
+	size_t current = origin.load();
+	while(value < current && !origin.compare_exchange_weak(current, value));
+}
+
+/*
+ * Besides each element of the basis, `origins` ends up holding the smallest
+ * index in `polynomials` of a polynomial that the element divides: a new
+ * element divides the polynomial of its item, a split piece or a remainder
+ * divides the element it comes from, and an element found to divide an item
+ * is lowered to the item's origin. Unlike the order of the elements, this does
+ * not depend on the scheduling.
+ */
 void factorisation_worker(
 	std::shared_mutex* mtx,
-	deque<pair<size_t, Univariate>>* waiting_queue,
+	deque<FactorisationItem>* waiting_queue,
 	mutex* waiting_queue_mtx,
 	deque<atomic<Univariate*>>* basis,
+	deque<atomic<size_t>>* origins,
 	atomic<size_t>* basis_size
 ) {
 	/*
@@ -91,8 +499,9 @@ void factorisation_worker(
 			return;
 		}
 
-		size_t iElement = waiting_queue->back().first;
-		Univariate poly = waiting_queue->back().second;
+		size_t iElement = waiting_queue->back().iElement;
+		size_t origin = waiting_queue->back().origin;
+		Univariate poly = waiting_queue->back().poly;
 		waiting_queue->pop_back();
 
 		waiting_queue_mtx->unlock();
@@ -105,6 +514,7 @@ void factorisation_worker(
 					Univariate* ptr = new Univariate();
 					*ptr = poly;
 					basis->emplace_back(ptr);
+					origins->emplace_back(origin);
 					(*basis_size)++;
 
 					mtx->unlock();
@@ -136,6 +546,8 @@ void factorisation_worker(
 						Univariate* oldElement = (*basis)[iElement];
 						(*basis)[iElement] = ptr;
 						delete oldElement;
+						size_t element_origin = (*origins)[iElement];
+						lower_origin((*origins)[iElement], origin);
 
 						/* Strange: computing simplified is faster here than before the lock */
 						Univariate simplified = element;
@@ -144,12 +556,22 @@ void factorisation_worker(
 						}
 						if(simplified.size() > 1) {
 							waiting_queue_mtx->lock();
-							waiting_queue->push_back({iElement+1, simplified});
+							waiting_queue->push_back({iElement+1, element_origin, simplified});
 							waiting_queue_mtx->unlock();
 						}
 						simplify_poly = true;
 					}
 					mtx->unlock();
+				} else {
+					/* Checked under the lock, so that a split of the element
+					 * cannot have handed its old origin to a remainder already */
+					mtx->lock_shared();
+					if(element == *((*basis)[iElement])) {
+						lower_origin((*origins)[iElement], origin);
+					} else {
+						simplify_poly = false;
+					}
+					mtx->unlock_shared();
 				}
 
 				if (simplify_poly) {
@@ -165,22 +587,93 @@ void factorisation_worker(
 }
 
 void RelationGenerator::prepareBasis(void) {
+   if(isPipelined()) {
+      pipeline_queue->close();
+      pipeline_thread.join();
+
+      vector<size_t> alive = pipeline_basis.aliveElements();
+      parallel_sort(alive.begin(), alive.end(), [this](size_t a, size_t b) {
+         return pipeline_basis.element(a) < pipeline_basis.element(b);
+      }, nbThreads);
+
+      polynomial_basis.clear();
+      basis_trial_order.clear();
+      for(size_t iFactor = 0;iFactor < alive.size();iFactor++) {
+         polynomial_basis.push_back(pipeline_basis.element(alive[iFactor]));
+         basis_trial_order.push_back(iFactor);
+      }
+      return;
+   }
+
+   polynomial_basis.clear();
+   basis_trial_order.clear();
+   refineBasis(0);
+
+   kernel = IncrementalKernel();
+   kernel_columns.assign(polynomial_basis.size(), NO_KERNEL_COLUMN);
+   nb_kernel_columns = 0;
+   nb_reduced_fractions = 0;
+   split_columns.clear();
+}
+
+/*
+ * The old elements keep their columns. A split one keeps its column too, until
+ * reduceDecompositions() replaces it by its pieces in the reduced rows.
+ */
+void RelationGenerator::extendBasis(void) {
+   if(isPipelined()) {
+      prepareBasis();
+      return;
+   }
+
+   vector<Univariate> old_basis = polynomial_basis;
+   vector<size_t> old_columns = kernel_columns;
+   refineBasis(nb_basis_polynomials);
+
+   kernel_columns.assign(polynomial_basis.size(), NO_KERNEL_COLUMN);
+   vector<bool> kept(old_basis.size(), false);
+   for(size_t iFactor = 0;iFactor < polynomial_basis.size();iFactor++) {
+      auto it = lower_bound(old_basis.begin(), old_basis.end(), polynomial_basis[iFactor]);
+      if(it != old_basis.end() && *it == polynomial_basis[iFactor]) {
+         kept[it - old_basis.begin()] = true;
+         kernel_columns[iFactor] = old_columns[it - old_basis.begin()];
+      }
+   }
+   for(size_t iOld = 0;iOld < old_basis.size();iOld++) {
+      if(!kept[iOld] && old_columns[iOld] != NO_KERNEL_COLUMN) {
+         split_columns.push_back({old_columns[iOld], decompose(old_basis[iOld], polynomial_basis, basis_trial_order)});
+      }
+   }
+}
+
+/*
+ * Refines the current basis, in its trial order, with `polynomials` from
+ * `first_polynomial` on. The elements count as polynomials before them for
+ * the trial order, since they divide the earlier polynomials.
+ */
+void RelationGenerator::refineBasis(size_t first_polynomial) {
    vector<thread> threads(nbThreads);
    std::shared_mutex mtx;
 
-   deque<pair<size_t, Univariate>> waiting_queue;
+   size_t nb_seeds = polynomial_basis.size();
+   deque<FactorisationItem> waiting_queue;
    mutex waiting_queue_mtx;
-   for(Univariate poly : polynomials) {
-   	waiting_queue.push_front({0, poly});
+   for(size_t iPoly = first_polynomial;iPoly < polynomials.size();iPoly++) {
+      waiting_queue.push_front({0, nb_seeds + iPoly - first_polynomial, polynomials[iPoly]});
    }
 
    deque<atomic<Univariate*>> basis;
-   atomic<size_t> basis_size = 0;
+   deque<atomic<size_t>> origins;
+   for(size_t iSeed = 0;iSeed < nb_seeds;iSeed++) {
+      basis.emplace_back(new Univariate(polynomial_basis[basis_trial_order[iSeed]]));
+      origins.emplace_back(iSeed);
+   }
+   atomic<size_t> basis_size = nb_seeds;
 
    for(auto& thread_i: threads) {
       thread_i = thread(
          factorisation_worker,
-         &mtx, &waiting_queue, &waiting_queue_mtx, &basis, &basis_size
+         &mtx, &waiting_queue, &waiting_queue_mtx, &basis, &origins, &basis_size
       );
    }
 
@@ -203,11 +696,42 @@ void RelationGenerator::prepareBasis(void) {
       thread_i.join();
    }
 
+   vector<Univariate> found_basis;
    for(Univariate* poly : basis) {
-      polynomial_basis.push_back(*poly);
+      found_basis.push_back(*poly);
+      found_basis.back().toMonic();
       delete poly;
    }
 
+   /* The order found depends on the scheduling, the canonical one does not */
+   vector<size_t> canonical_order(found_basis.size());
+   for(size_t iFactor = 0;iFactor < found_basis.size();iFactor++) {
+      canonical_order[iFactor] = iFactor;
+   }
+   parallel_sort(canonical_order.begin(), canonical_order.end(), [&found_basis](size_t a, size_t b) {
+      return found_basis[a] < found_basis[b];
+   }, nbThreads);
+
+   polynomial_basis.clear();
+   for(size_t iFactor = 0;iFactor < canonical_order.size();iFactor++) {
+      polynomial_basis.push_back(found_basis[canonical_order[iFactor]]);
+   }
+
+   /* Factors of the first polynomials are the most common ones, so trying
+      them first makes the decompositions end early; ties go by canonical index */
+   vector<size_t> canonical_origins(canonical_order.size());
+   for(size_t iFactor = 0;iFactor < canonical_order.size();iFactor++) {
+      canonical_origins[iFactor] = origins[canonical_order[iFactor]];
+   }
+   basis_trial_order.resize(canonical_order.size());
+   for(size_t iFactor = 0;iFactor < basis_trial_order.size();iFactor++) {
+      basis_trial_order[iFactor] = iFactor;
+   }
+   parallel_sort(basis_trial_order.begin(), basis_trial_order.end(), [&canonical_origins](size_t a, size_t b) {
+      return canonical_origins[a] < canonical_origins[b] || (canonical_origins[a] == canonical_origins[b] && a < b);
+   }, nbThreads);
+   nb_basis_polynomials = polynomials.size();
+
 #if 0
    cout << KCYN "BASIS: size:" << polynomial_basis.size() << KRST << endl;
    for(auto poly : polynomial_basis) {
@@ -220,52 +744,87 @@ void RelationGenerator::prepareBasis(void) {
 /* This function is used to stress-test our setup, e.g. relations size should be independent of this */
 void RelationGenerator::shuffleBasis(void) {
    auto rng = std::default_random_engine {};
-   std::shuffle(std::begin(polynomial_basis), std::end(polynomial_basis), rng);
+   vector<size_t> permutation(polynomial_basis.size());
+   for(size_t iFactor = 0;iFactor < permutation.size();iFactor++) {
+      permutation[iFactor] = iFactor;
+   }
+   std::shuffle(std::begin(permutation), std::end(permutation), rng);
+
+   vector<Univariate> shuffled(polynomial_basis.size());
+   for(size_t iFactor = 0;iFactor < permutation.size();iFactor++) {
+      shuffled[permutation[iFactor]] = polynomial_basis[iFactor];
+   }
+   for(size_t& iFactor : basis_trial_order) {
+      iFactor = permutation[iFactor];
+   }
+   polynomial_basis = shuffled;
+
+   if(!kernel_columns.empty()) {
+      vector<size_t> shuffled_columns(kernel_columns.size());
+      for(size_t iFactor = 0;iFactor < permutation.size();iFactor++) {
+         shuffled_columns[permutation[iFactor]] = kernel_columns[iFactor];
+      }
+      kernel_columns = shuffled_columns;
+   }
 }
 
+/* Fractions claimed at once by a decomposition worker */
+constexpr size_t DECOMPOSITION_CHUNK = 16;
+
+/* Each fraction is claimed by one worker, which alone writes its row */
 void decomposition_worker(
-	mutex* mtx,
-	deque<Fraction<Univariate>>* waiting_queue,
+	size_t first,
+	atomic<size_t>* next_fraction,
+	const vector<Fraction<Univariate>>* fractions,
 	const vector<Univariate>* basis,
+	const vector<size_t>* trial_order,
+	const vector<FactoredFraction::Factors>* denominator_factors,
+	const vector<MatrixRow<Rational>>* factor_decompositions,
 	Matrix<Rational>* decompositions) {
 
 	while(true) {
-		mtx->lock();
-
-		if(waiting_queue->empty()) {
-			mtx->unlock();
+		size_t begin = next_fraction->fetch_add(DECOMPOSITION_CHUNK);
+		if(begin >= fractions->size()) {
 			return;
 		}
+		size_t end = min(begin + DECOMPOSITION_CHUNK, fractions->size());
 
-		Fraction<Univariate> fraction = waiting_queue->back();
-		waiting_queue->pop_back();
-		size_t id = waiting_queue->size();
-
-		mtx->unlock();
+		for(size_t id = begin;id < end;id++) {
+			const Fraction<Univariate>& fraction = (*fractions)[id];
 
-		MatrixRow<Rational> numerator = decompose(fraction.getNumerator(), *basis);
-		MatrixRow<Rational> denominator = decompose(fraction.getDenominator(), *basis);
-
-		MatrixRow<Rational> decomposition = numerator - denominator;
+			MatrixRow<Rational> decomposition = decompose(fraction.getNumerator(), *basis, *trial_order);
+			if((*denominator_factors)[id].empty()) {
+				decomposition = decomposition - MatrixRow<Rational>(decompose(fraction.getDenominator(), *basis, *trial_order));
+			} else {
+				for(auto& factor : (*denominator_factors)[id]) {
+					decomposition = decomposition - Rational(factor.second) * (*factor_decompositions)[factor.first];
+				}
+			}
 
-		mtx->lock();
-		decompositions->coeffs[id] = decomposition;
-		mtx->unlock();
+			decompositions->coeffs[id - first] = std::move(decomposition);
+		}
 	}
 }
 
-void RelationGenerator::printRelations() {
-   auto t1 = std::chrono::high_resolution_clock::now();
-   Matrix<Rational> decompositions(rational_fractions.size(), 0);
+Matrix<Rational> RelationGenerator::decomposeFractions(size_t first) {
+   Matrix<Rational> decompositions(rational_fractions.size() - first, 0);
 
    vector<thread> threads(nbThreads);
-   mutex mtx;
-   deque<Fraction<Univariate>> waiting_queue(rational_fractions.begin(), rational_fractions.end());
+   atomic<size_t> next_fraction(first);
+
+   vector<MatrixRow<Rational>> factor_decompositions;
+   for(size_t id = 0;id < factor_added.size();id++) {
+      if (factor_added[id]) {
+         factor_decompositions.push_back(decompose(denominatorFactors.get(id), polynomial_basis, basis_trial_order));
+      } else {
+         factor_decompositions.push_back(MatrixRow<Rational>(0));
+      }
+   }
 
    for(auto& thread_i: threads) {
       thread_i = thread(
          decomposition_worker,
-         &mtx, &waiting_queue, &polynomial_basis, &decompositions
+         first, &next_fraction, &rational_fractions, &polynomial_basis, &basis_trial_order, &denominator_factors, &factor_decompositions, &decompositions
       );
    }
 
@@ -273,21 +832,125 @@ void RelationGenerator::printRelations() {
       thread_i.join();
    }
 
-   decompositions.actualizeNCols();
-   auto t2 = std::chrono::high_resolution_clock::now();
+   return decompositions;
+}
+
+Matrix<Rational> RelationGenerator::reduceDecompositions(const Matrix<Rational>& decompositions) {
+   vector<size_t> nb_uses(polynomial_basis.size(), 0);
+   for(auto& row : decompositions.coeffs) {
+      for(auto& entry : row.coeffs) {
+         nb_uses[entry.first]++;
+      }
+   }
+
+   /* New columns, densest first: on a first batch, this is the order of prepare_matrix() */
+   vector<bool> needed(polynomial_basis.size(), false);
+   fill(needed.begin(), needed.begin() + min(decompositions.nbCols(), needed.size()), true);
+   for(auto& split : split_columns) {
+      for(auto& entry : split.second.coeffs) {
+         needed[entry.first] = true;
+      }
+   }
+   vector<size_t> new_columns;
+   for(size_t iFactor = 0;iFactor < polynomial_basis.size();iFactor++) {
+      if(needed[iFactor] && kernel_columns[iFactor] == NO_KERNEL_COLUMN) {
+         new_columns.push_back(iFactor);
+      }
+   }
+   sort(new_columns.begin(), new_columns.end(), [&nb_uses](size_t a, size_t b) {
+      return nb_uses[a] > nb_uses[b];
+   });
+   for(size_t iFactor : new_columns) {
+      kernel_columns[iFactor] = nb_kernel_columns++;
+   }
+
+   auto to_kernel_columns = [this](const MatrixRow<Rational>& row) {
+      vector<pair<size_t, Rational>> coeffs;
+      coeffs.reserve(row.coeffs.size());
+      for(auto& entry : row.coeffs) {
+         coeffs.push_back({kernel_columns[entry.first], entry.second});
+      }
+      sort(coeffs.begin(), coeffs.end(), [](const pair<size_t, Rational>& a, const pair<size_t, Rational>& b) {
+         return a.first < b.first;
+      });
+      return coeffs;
+   };
+
+   for(auto& split : split_columns) {
+      vector<pair<size_t, int>> expansion;
+      for(auto& piece : to_kernel_columns(split.second)) {
+         expansion.push_back({piece.first, (int)piece.second.getNumerator().to_int64()});
+      }
+      kernel.splitColumn(split.first, expansion);
+   }
+   split_columns.clear();
+
+   Matrix<Rational> relations(0, 0);
+   for(size_t iRow = 0;iRow < decompositions.nbRows();iRow++) {
+      MatrixRow<Rational> row(to_kernel_columns(decompositions.coeffs[iRow]));
+      MatrixRow<Rational> relation = kernel.addRow(nb_reduced_fractions + iRow, row);
+      if(!relation.coeffs.empty()) {
+         relations.coeffs.push_back(relation);
+      }
+   }
+   nb_reduced_fractions += decompositions.nbRows();
+   relations.actualizeNCols();
+   return relations;
+}
+
+/* Relations claimed at once by a classification worker: their costs vary a lot */
+constexpr size_t CLASSIFICATION_CHUNK = 4;
 
-   std::chrono::duration<float> e21 = t2 - t1;
-   cerr << "Factored " << rational_fractions.size() << " fractions"
-        << KGRY << " (" << e21.count() << "s)" KRST << endl;
+void classification_worker(atomic<size_t>* next_relation, vector<Relation>* relations) {
+	while(true) {
+		size_t begin = next_relation->fetch_add(CLASSIFICATION_CHUNK);
+		if(begin >= relations->size()) {
+			return;
+		}
+		size_t end = min(begin + CLASSIFICATION_CHUNK, relations->size());
 
-   auto t3 = std::chrono::high_resolution_clock::now();
-   decompositions = prepare_matrix(decompositions);
-   Matrix<Rational> relations_matrix = kernel_basis(decompositions);
-   auto t4 = std::chrono::high_resolution_clock::now();
+		for(size_t id = begin;id < end;id++) {
+			MetricTimer relation_timer(METRIC_CLASSIFY_RELATION);
+			(*relations)[id].classify();
+		}
+	}
+}
+
+void RelationGenerator::printRelations() {
+   Matrix<Rational> relations_matrix(0, 0);
+   float kernel_seconds;
+   if(isPipelined()) {
+      /* Already reduced by the pipeline, as the fractions arrived: report the time it took there */
+      swap(relations_matrix.coeffs, pipeline_relations);
+      relations_matrix.actualizeNCols();
+      uint64_t kernel_ns = Metrics::nanoseconds(METRIC_PIPELINE_KERNEL);
+      kernel_seconds = (kernel_ns - pipeline_kernel_reported_ns) * 1e-9;
+      pipeline_kernel_reported_ns = kernel_ns;
+   } else {
+      Matrix<Rational> decompositions(0, 0);
+      if(has_loaded_decompositions) {
+         swap(decompositions, loaded_decompositions);
+         has_loaded_decompositions = false;
+      } else {
+         MetricTimer decompose_timer(METRIC_DECOMPOSE);
+         decompositions = decomposeFractions(nb_reduced_fractions);
+         decompositions.actualizeNCols();
+         float decompose_seconds = decompose_timer.stop();
+
+         cerr << "Factored " << decompositions.nbRows() << " fractions"
+              << KGRY << " (" << decompose_seconds << "s)" KRST << endl;
+         if(nb_reduced_fractions == 0) {
+            saveCheckpoint(CHECKPOINT_DECOMPOSITIONS, &decompositions);
+         }
+      }
+
+      MetricTimer kernel_timer(METRIC_KERNEL);
+      relations_matrix = reduceDecompositions(decompositions);
+      kernel_seconds = kernel_timer.stop();
+   }
 
-   std::chrono::duration<float> e43 = t4 - t3;
    cerr << "Relations computed. " << "Size: " << relations_matrix.nbRows() << " * " << relations_matrix.nbCols()
-        << KGRY << " (" << e43.count() << "s)" KRST << endl;
+        << KGRY << " (" << kernel_seconds << "s)" KRST << endl;
 
 
    vector<Relation> relations;
@@ -295,22 +958,31 @@ void RelationGenerator::printRelations() {
       relations.push_back(Relation(relation_row.coeffs, names));
    }
 
-   auto t5 = std::chrono::high_resolution_clock::now();
-   for(auto& relation: relations) {
-       relation.classify();
+   MetricTimer classify_timer(METRIC_CLASSIFY);
+   vector<thread> threads(nbThreads);
+   atomic<size_t> next_relation(0);
+   for(auto& thread_i: threads) {
+      thread_i = thread(classification_worker, &next_relation, &relations);
    }
-   std::sort(relations.begin(), relations.end());
-   auto t6 = std::chrono::high_resolution_clock::now();
+   for(auto& thread_i: threads) {
+      thread_i.join();
+   }
+   parallel_sort(relations.begin(), relations.end(), nbThreads);
+   float classify_seconds = classify_timer.stop();
 
-   std::chrono::duration<float> e65 = t6 - t5;
    cerr << "Classified " << relations.size() << " relations"
-        << KGRY << " (" << e65.count() << "s)" KRST << endl;
-    #if DEBUG_TIME_CLASSIFY
-    size_t debug_idx = 0;
-    for (const auto& duration: relation_time_classify_debug) {
-        cerr << "RTCD " << debug_idx++ << " : " << duration.count() << "s" << endl;
-    }
-    #endif /* DEBUG_TIME_CLASSIFY */
+        << KGRY << " (" << classify_seconds << "s)" KRST << endl;
+   if(classify_stats) {
+      /* Cumulated over the run */
+      Relation::print_classifier_stats(cerr);
+      if(!classify_stats_json_path.empty()) {
+         ofstream json(classify_stats_json_path);
+         Relation::print_classifier_stats_json(json);
+         if(!json) {
+            cerr << KRED "Cannot write " << classify_stats_json_path << KRST << endl;
+         }
+      }
+   }
 
 
    for(auto& relation: relations) {
@@ -1,17 +1,20 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
-#include <set>
 #include <sstream>
 #include <vector>
 #include "fraction.h"
 #include "hformula.h"
 using namespace std;
 
-#define DEBUG_TIME_CLASSIFY 0
-#if DEBUG_TIME_CLASSIFY
-    vector<std::chrono::duration<float>> relation_time_classify_debug;
-#endif /* DEBUG_TIME_CLASSIFY */
 
 class Relation {
 private:
@@ -19,6 +22,7 @@ private:
     std::vector<Element> elements;
     bool known = false;
     std::string known_formula;
+    std::string sort_key; /* Set by classify(), see make_sort_key() */
 
     void normalize() {
         /* To be called once at the end of the constructor. Improves printing and formula detection */
@@ -142,54 +146,39 @@ private:
         return cplen;
     }
 
-    bool nat_cmp(const string& a, const string& b) const {
-        std::string::size_type ia = 0, ib = 0;
-        bool in_nb = false;
-
-        while((ia < a.size()) && (ib < b.size())) {
-            if (in_nb) {
-                uint64_t nata = 0, natb = 0;
-                while ((ia < a.size()) && (utf8_helper(a, ia) == 1) && isdigit(a[ia])) {
-                    nata = (10*nata) + (a[ia] - '0');
-                    ia++;
-                }
-                while ((ib < b.size()) && (utf8_helper(b, ib) == 1) && isdigit(b[ib])) {
-                    natb = (10*natb) + (b[ib] - '0');
-                    ib++;
+    /*
+     * Appends a byte string ordered as the natural order of strings: runs of
+     * digits compare by value, other characters by UTF-8 width then by bytes
+     * (as signed chars), and a string sorts before its own prefixes.
+     * A character is its width then its bytes with the sign bit flipped. A
+     * run of digits is width 1, the flipped byte of '0' (so it compares to
+     * other characters as any digit does), then its value on 8 bytes,
+     * big-endian. The end of the string is 0xFF, above any width.
+     */
+    void append_nat_key(std::string& key, const string& str) const {
+        std::string::size_type idx = 0;
+        while (idx < str.size()) {
+            size_t width = utf8_helper(str, idx);
+            if ((width == 1) && isdigit(str[idx])) {
+                uint64_t nat = 0;
+                while ((idx < str.size()) && (utf8_helper(str, idx) == 1) && isdigit(str[idx])) {
+                    nat = (10*nat) + (str[idx] - '0');
+                    idx++;
                 }
-                if (nata != natb) {
-                    return nata < natb;
+                key.push_back(1);
+                key.push_back('0' ^ 0x80);
+                for (int shift = 56; shift >= 0; shift -= 8) {
+                    key.push_back((char)(nat >> shift));
                 }
-                in_nb = false;
             } else {
-                size_t wa = utf8_helper(a, ia);
-                size_t wb = utf8_helper(b, ib);
-
-                if ((wa == 1) && isdigit(a[ia]) && (wb == 1) && isdigit(b[ib])) {
-                    in_nb = true;
-                    continue;
-                }
-
-                if (wa != wb) {
-                    return wa < wb;
-                }
-                for(size_t i=0; i<min(wa,wb); i++) {
-                    if (a[ia+i] != b[ib+i]) {
-                        return a[ia+i] < b[ib+i];
-                    }
+                key.push_back((char)width);
+                for (size_t i=0; i<width; i++) {
+                    key.push_back(str[idx+i] ^ 0x80);
                 }
-
-                ia += wa;
-                ib += wb;
+                idx += width;
             }
         }
-
-        if (ia >= a.size()) {
-            return false;
-        } else if (ib >= b.size()) {
-            return true;
-        }
-        return false; /* Equal */
+        key.push_back((char)0xFF);
     }
 
     class RelationSummary {
@@ -203,12 +192,21 @@ private:
         Rational liouville = Rational(0);
         Rational tauk = Rational(0);
 
+        /* Dispatch keys, see may_match() */
+        uint32_t leaf_types = 0; /* Bit t set when an L-function has a leaf of type t */
+        size_t nb_lfuncs = 0;
+        size_t nb_zetas = 0;
+
+        RelationSummary() { }
+
         RelationSummary(const std::vector<Element>& elements) {
             for (auto& element: elements) {
                 const FormulaNode* name = element.first.get();
                 if (name->isZeta()) {
                     zeta += abs(element.second);
+                    nb_zetas++;
                 } else if (name->isLFuncNonZeta()) {
+                    nb_lfuncs++;
                     HFormula h_product = name->getLFuncProduct();
                     const FormulaNode* product = h_product.get();
                     for (size_t idx=0; idx<product->getProductSize(); idx++) {
@@ -219,6 +217,7 @@ private:
                             formula = formula->getPowerInner().get();
                         }
                         assert(formula->isLeaf());
+                        leaf_types |= 1u << formula->getLeafType();
                         Rational to_add = Rational(n_times) * abs(element.second);
                         if (formula->isMu()) {
                             mu += to_add;
@@ -248,6 +247,23 @@ private:
             return out;
         }
 
+        /*
+         * Necessary conditions for a relation of summary `relation` to be an
+         * instance of a formula of this summary: each element of the relation
+         * uses up a distinct element of the formula of the same kind, and an
+         * L-function only matches one with the same leaf types. A formula with
+         * a single L-function thus needs exactly its leaf types.
+         */
+        bool may_match(const RelationSummary& relation) const {
+            if ((relation.nb_lfuncs > nb_lfuncs) || (relation.nb_zetas > nb_zetas)) {
+                return false;
+            }
+            if (nb_lfuncs == 1) {
+                return relation.leaf_types == leaf_types;
+            }
+            return (relation.leaf_types & ~leaf_types) == 0;
+        }
+
         typedef std::function<bool (const RelationSummary&)> instance_early_bailout;
         static bool no_early_bailout([[maybe_unused]] const RelationSummary&) {
             return true;
@@ -256,23 +272,71 @@ private:
 
     class SymbolicInstantiation {
     public:
-        typedef std::unordered_map<std::string, SomeInt> assignment;
+        /* Values of the variables instantiated so far, by Symbolic variable number */
+        class assignment {
+        public:
+            bool has(int var) const {
+                return (assigned >> var) & 1;
+            }
+            const SomeInt& operator [] (int var) const {
+                assert(has(var));
+                return values[var];
+            }
+            void set(int var, const SomeInt& value) {
+                values[var] = value;
+                assigned |= 1u << var;
+            }
+            size_t size() const {
+                return __builtin_popcount(assigned);
+            }
+            /* Variables instantiated after mark() are forgotten by undo() */
+            uint32_t mark() const {
+                return assigned;
+            }
+            void undo(uint32_t marked) {
+                assigned = marked;
+            }
+        private:
+            uint32_t assigned = 0;
+            SomeInt values[FormulaNode::Symbolic::NB_VARIABLES];
+        };
+        /*
+         * Elements of one side, in slots; those left to match are set in
+         * `left`. A relation element matched with part of its power leaves
+         * its remainder in a new slot, freed when the search backtracks.
+         */
+        struct Side {
+            static const size_t MAX_SLOTS = 64;
+            const HFormula* formulas[MAX_SLOTS];
+            Rational powers[MAX_SLOTS];
+            size_t nb_slots = 0;
+            size_t nb_elements = 0; /* Slots before are elements, after are remainders */
+            uint64_t left = 0;
+
+            void add(const HFormula& formula, const Rational& power) {
+                assert(nb_slots < MAX_SLOTS);
+                formulas[nb_slots] = &formula;
+                powers[nb_slots] = power;
+                left |= 1ull << nb_slots;
+                nb_slots++;
+            }
+            void addElements(const std::vector<Element>& elements) {
+                for (auto& element: elements) {
+                    add(element.first, element.second);
+                }
+                nb_elements = nb_slots;
+            }
+        };
+
         assignment variables;
-        std::set<const Element*> relation_elements;
-        std::set<const Element*> formula_elements;
+        Side relation_elements;
+        Side formula_elements;
 
         SymbolicInstantiation(const std::vector<Element>& relation, const std::vector<Element>& formula) {
-            for (auto& element: relation) {
-                bool is_in = relation_elements.find(&element) != relation_elements.end();
-                assert(!is_in); /* Do we need multiset? */
-                relation_elements.insert(&element);
-            }
-            for (auto& element: formula) {
-                bool is_in = formula_elements.find(&element) != formula_elements.end();
-                assert(!is_in); /* Do we need multiset? */
-                formula_elements.insert(&element);
-            }
+            relation_elements.addElements(relation);
+            formula_elements.addElements(formula);
         }
+        SymbolicInstantiation() { }
     };
 
 public:
@@ -348,92 +412,62 @@ public:
     }
 
     bool operator < (const Relation& other) const {
-        if (known != other.known) {
-            return known > other.known;
-        }
-        if (known && (known_formula != other.known_formula)) {
-            if (known_formula[0] != other.known_formula[0]) {
-                return known_formula[0] > other.known_formula[0]; /* Hack */
-            }
-            return nat_cmp(known_formula, other.known_formula);
-        }
-        std::ostringstream ss, other_ss;
-        ss << *this;
-        other_ss << other;
-        return nat_cmp(ss.str(), other_ss.str());
+        assert(!sort_key.empty() && !other.sort_key.empty());
+        return sort_key < other.sort_key;
     }
 
 private:
+    /*
+     * Known relations first, D before C (a hack on the first letter), then in
+     * the natural order of their formula names, then of their printed form.
+     */
+    std::string make_sort_key() const {
+        std::string key;
+        key.push_back(known ? 0 : 1);
+        if (known) {
+            key.push_back((char)(0x7F - (signed char)known_formula[0]));
+            append_nat_key(key, known_formula);
+        }
+        std::ostringstream printed;
+        printed << *this;
+        append_nat_key(key, printed.str());
+        return key;
+    }
+
     void classify_raw(std::string formula) {
         known_formula = formula;
         known = true;
     }
 
-    vector<string> instantiate_split_helper(const string& str, const string& delimiter) const {
-        vector<string> tokens;
-        size_t prev = 0;
-        size_t pos = 0;
-        do
-        {
-            pos = str.find(delimiter, prev);
-            if (pos == string::npos) {
-                pos = str.length();
-            }
-            string token = str.substr(prev, pos-prev);
-            tokens.push_back(token);
-            prev = pos + delimiter.length();
-        }
-        while ((pos < str.length()) && (prev < str.length()));
-        return tokens;
-    }
-
-    bool instantiate_eval_helper(FormulaNode::Symbolic symbolic,
-                                 const SymbolicInstantiation& instantiation,
+    bool instantiate_eval_helper(const FormulaNode::Symbolic& symbolic,
+                                 const SymbolicInstantiation::assignment& variables,
                                  SomeInt* out_sum,
                                  unsigned int* out_uninstanticated_var_cnt,
-                                 string* out_uninstanticated_var_name,
+                                 int* out_uninstanticated_var,
                                  SomeInt* out_uninstanticated_var_times,
                                  int debug) const {
-        vector<string> n_symbols = instantiate_split_helper(symbolic.str, "+");
         unsigned int uninstanticated_var_cnt = 0;
-        string uninstanticated_var_name;
+        int uninstanticated_var = -1;
         SomeInt uninstanticated_var_times = 0;
         SomeInt sum = 0;
-        for (auto n_symbol: n_symbols) {
-            SomeInt times;
-            string n_symbol2;
-            if (n_symbol[0] == '-') {
-                times = -1;
-                n_symbol2 = n_symbol.substr(1);
-            } else {
-                times = 1;
-                n_symbol2 = n_symbol;
-            }
-            vector<string> tmp = instantiate_split_helper(n_symbol2, "*");
-            string name;
-            bool found_unkown_var = false;
-            
-            for (size_t pos = 0; pos < tmp.size(); pos++) {
-                if (tmp[pos][0] >= '0' && tmp[pos][0] <= '9') {
-                    times = times * std::stoi(tmp[pos]);
+        for (const FormulaNode::Symbolic::Term& term: symbolic.terms) {
+            SomeInt times = term.coeff;
+            int var = -1;
+
+            for (int term_var: term.vars) {
+                if (variables.has(term_var)) {
+                    times = times * variables[term_var];
+                } else if (var >= 0) {
+                    /* We do not handle when the first part has not been instantiated. Do better someday? */
+                    if (debug>=0) { cerr << string(debug, ' ') << __func__ << " I " KGRY "UPR" KRST << endl; }
+                    return false;
                 } else {
-                    auto it = instantiation.variables.find(tmp[pos]);
-                    if (it != instantiation.variables.end()) {
-                        times = times * (it->second);
-                    } else if (found_unkown_var) {
-                        /* We do not handle when the first part has not been instantiated. Do better someday? */
-                        if (debug>=0) { cerr << string(debug, ' ') << __func__ << " I " KGRY "UPR" KRST << endl; }
-                        return false;
-                    } else {
-                        name = tmp[pos];
-                        found_unkown_var = true;
-                    }
+                    var = term_var;
                 }
             }
-            assert (!found_unkown_var || name.size() == 1);
-            if (found_unkown_var) {
+            if (var >= 0) {
                 if (uninstanticated_var_cnt > 0) {
-                    if (name[0] == uninstanticated_var_name[0]) {
+                    if (var == uninstanticated_var) {
                         uninstanticated_var_times += times;
                     } else {
                         /* We cannot instantiate more than one, bail out for now. Do better someday? */
@@ -441,7 +475,7 @@ private:
                         return false;
                     }
                 }
-                uninstanticated_var_name = name;
+                uninstanticated_var = var;
                 uninstanticated_var_times = times;
                 uninstanticated_var_cnt++;
             } else {
@@ -455,8 +489,8 @@ private:
         if (out_uninstanticated_var_cnt != NULL) {
             *out_uninstanticated_var_cnt = uninstanticated_var_cnt;
         }
-        if (out_uninstanticated_var_name != NULL) {
-            *out_uninstanticated_var_name = uninstanticated_var_name;
+        if (out_uninstanticated_var != NULL) {
+            *out_uninstanticated_var = uninstanticated_var;
         }
         if (out_uninstanticated_var_times != NULL) {
             *out_uninstanticated_var_times = uninstanticated_var_times;
@@ -472,16 +506,16 @@ private:
         return debug;
     }
 
-    bool try_instantiate(FormulaNode::MaybeSymbolic should_be_value, FormulaNode::MaybeSymbolic maybe_symbolic,
-                         SymbolicInstantiation& instantiation, int debug) const {
+    bool try_instantiate(const FormulaNode::MaybeSymbolic& should_be_value, const FormulaNode::MaybeSymbolic& maybe_symbolic,
+                         SymbolicInstantiation::assignment& variables, int debug) const {
         if (debug>=0) { cerr << string(debug, ' ') << __func__ << " I " << should_be_value << " wrt " << maybe_symbolic << endl; }
         SomeInt value;
         if (should_be_value.is_symbolic()) {
             /* We only accept values on the left side. Fully-instantiated symbolic is OK. */
-            FormulaNode::Symbolic symbolic = should_be_value.extract_symbol();
+            const FormulaNode::Symbolic& symbolic = should_be_value.extract_symbol();
             unsigned int uninstanticated_var_cnt = 0;
             SomeInt sum = 0;
-            bool good = instantiate_eval_helper(symbolic, instantiation, &sum, &uninstanticated_var_cnt,
+            bool good = instantiate_eval_helper(symbolic, variables, &sum, &uninstanticated_var_cnt,
                                                 NULL, NULL, iincr(debug));
             if (!good || (uninstanticated_var_cnt > 0)) {
                 return false;
@@ -493,13 +527,13 @@ private:
         if (!maybe_symbolic.is_symbolic()) {
             return value == maybe_symbolic.extract_value();
         }
-        FormulaNode::Symbolic symbolic = maybe_symbolic.extract_symbol();
+        const FormulaNode::Symbolic& symbolic = maybe_symbolic.extract_symbol();
         unsigned int uninstanticated_var_cnt = 0;
-        string uninstanticated_var_name;
+        int uninstanticated_var = -1;
         SomeInt uninstanticated_var_times = 0;
         SomeInt sum = 0;
-        bool good = instantiate_eval_helper(symbolic, instantiation, &sum, &uninstanticated_var_cnt,
-                                            &uninstanticated_var_name, &uninstanticated_var_times, iincr(debug));
+        bool good = instantiate_eval_helper(symbolic, variables, &sum, &uninstanticated_var_cnt,
+                                            &uninstanticated_var, &uninstanticated_var_times, iincr(debug));
         if (!good) {
             return false;
         }
@@ -509,11 +543,10 @@ private:
             SomeInt remaining = value - sum;
             if (remaining % uninstanticated_var_times == SomeInt(0)) {
                 SomeInt newvar_value = remaining / uninstanticated_var_times;
-                std::pair<std::string, SomeInt> new_elem (uninstanticated_var_name, newvar_value);
-                instantiation.variables.insert(new_elem);
+                variables.set(uninstanticated_var, newvar_value);
                 if (debug>=0) {
                     cerr << string(debug, ' ') << __func__ << " I "
-                         << KBLD << uninstanticated_var_name << ":=" << newvar_value << KRST << endl;
+                         << KBLD << (char)('a' + uninstanticated_var) << ":=" << newvar_value << KRST << endl;
                 }
                 sum += uninstanticated_var_times*newvar_value;
                 assert(sum == value);
@@ -526,116 +559,115 @@ private:
         return true; /* O RLY? */
     }
 
-    bool try_instantiate_product(const vector<HFormula>& v_rel, const vector<HFormula>& v_form,
-                                 SymbolicInstantiation& instantiation, int debug) const {
-            if((v_rel.size() == 0) && (v_form.size() == 0)) {
+    /* Up to this many leaves in a product, once powers are expanded */
+    static const size_t MAX_PRODUCT_LEAVES = 32;
+
+    /* Expands the powers of `product` into `leaves`; returns the number of leaves */
+    size_t flatten_product(const FormulaNode* product, const HFormula** leaves) const {
+        size_t nb_leaves = 0;
+        for (size_t idx=0; idx<product->getProductSize(); idx++) {
+            const HFormula& formula = product->getProductElem(idx);
+            size_t n_times = 1;
+            const HFormula* inner = &formula;
+            if (formula.get()->isPower()) {
+                n_times = formula.get()->getPower();
+                inner = &formula.get()->getPowerInner();
+            }
+            for (size_t times=0; times<n_times; times++) {
+                assert(nb_leaves < MAX_PRODUCT_LEAVES);
+                leaves[nb_leaves++] = inner;
+            }
+        }
+        return nb_leaves;
+    }
+
+    /* Matches the leaves left in `rel_left` one-to-one with those in `form_left` */
+    bool try_instantiate_product(const HFormula* const* v_rel, uint32_t rel_left,
+                                 const HFormula* const* v_form, uint32_t form_left,
+                                 SymbolicInstantiation::assignment& variables, int debug) const {
+            if((rel_left == 0) && (form_left == 0)) {
                 return true; /* Nothing (a.k.a everything) matches */
             }
-            if (debug>=0) { cerr << string(debug, ' ') << __func__ << " TP " << v_rel.size() << " wrt " << v_form.size() << endl; }
-            for(size_t i=0; i<v_rel.size(); i++) {
-                for(size_t j=0; j<v_form.size(); j++) {
-                    SymbolicInstantiation new_instantiation = instantiation;
-                    bool good = try_instantiate(v_rel[i], v_form[j], new_instantiation, iincr(debug));
-                    if (good) {
-                        vector<HFormula> new_v_rel = v_rel;
-                        new_v_rel.erase(new_v_rel.begin() + i);
-                        vector<HFormula> new_v_form = v_form;
-                        new_v_form.erase(new_v_form.begin() + j);
-                        good = try_instantiate_product(new_v_rel, new_v_form, new_instantiation, iincr(debug));
-                        if (good) {
-                            instantiation = new_instantiation;
-                            return true;
-                        }
+            if (debug>=0) { cerr << string(debug, ' ') << __func__ << " TP " << __builtin_popcount(rel_left) << " wrt " << __builtin_popcount(form_left) << endl; }
+            for(uint32_t rels = rel_left; rels != 0; rels &= rels - 1) {
+                size_t i = __builtin_ctz(rels);
+                for(uint32_t forms = form_left; forms != 0; forms &= forms - 1) {
+                    size_t j = __builtin_ctz(forms);
+                    uint32_t marked = variables.mark();
+                    if (try_instantiate(*v_rel[i], *v_form[j], variables, iincr(debug))
+                        && try_instantiate_product(v_rel, rel_left & ~(1u << i), v_form, form_left & ~(1u << j), variables, iincr(debug))) {
+                        return true;
                     }
+                    variables.undo(marked);
                 }
             }
             return false;
     }
 
-    bool try_instantiate(const HFormula& h_rel, const HFormula& h_form, SymbolicInstantiation& instantiation, int debug) const {
+    /* On failure, `variables` are left as they were */
+    bool try_instantiate(const HFormula& h_rel, const HFormula& h_form, SymbolicInstantiation::assignment& variables, int debug) const {
         if (debug>=0) { cerr << string(debug, ' ') << __func__ << " TX " << h_rel << " wrt " << h_form << endl; }
 
         const FormulaNode* rel = h_rel.get();
         const FormulaNode* form = h_form.get();
+        if ((h_rel == h_form) && !rel->isOne()) {
+            return true; /* Interned, so the same concrete formula: nothing to instantiate */
+        }
+        uint32_t marked = variables.mark();
         if (rel->isLeaf() && form->isLeaf()) {
             if (debug>=0) { cerr << string(debug, ' ') << __func__ << " TX L<->L" << endl; }
-            if (!rel->isLeafSameAs(form)) {
+            if (!rel->isLeafSameAs(form) || (rel->getLeafCompose() != form->getLeafCompose())) {
                 return false;
             }
-            SymbolicInstantiation new_instantiation = instantiation;
-            bool good = try_instantiate(rel->getLeafKS_dangerous(), form->getLeafKS_dangerous(), new_instantiation, iincr(debug));
-            if (good) {
-                good = try_instantiate(rel->getLeafLS_dangerous(), form->getLeafLS_dangerous(), new_instantiation, iincr(debug));
-                if (good) {
-                    instantiation = new_instantiation;
-                }
+            if (try_instantiate(rel->getLeafKS_dangerous(), form->getLeafKS_dangerous(), variables, iincr(debug))
+                && try_instantiate(rel->getLeafLS_dangerous(), form->getLeafLS_dangerous(), variables, iincr(debug))) {
+                return true;
             }
-            return good;
+            variables.undo(marked);
+            return false;
         } else if (rel->isLeaf() && form->isPower()) {
             if (debug>=0) { cerr << string(debug, ' ') << __func__ << " TX L<->P" << endl; }
             if ((!form->getPowerS().is_symbolic()) && (form->getPowerS().extract_value() == 1)) {
-                return try_instantiate(h_rel, form->getPowerInner(), instantiation, iincr(debug));
+                return try_instantiate(h_rel, form->getPowerInner(), variables, iincr(debug));
             }
         } else if (rel->isPower() && form->isLeaf()) {
             if (debug>=0) { cerr << string(debug, ' ') << __func__ << " TX P<->L" << endl; }
             if (rel->getPower() == 1) {
-                return try_instantiate(rel->getPowerInner(), h_form, instantiation, iincr(debug));
+                return try_instantiate(rel->getPowerInner(), h_form, variables, iincr(debug));
             }
         } else if (rel->isPower() && form->isPower()) {
-            SymbolicInstantiation new_instantiation = instantiation;
-            bool good = try_instantiate(rel->getPower(), form->getPowerS(), new_instantiation, iincr(debug));
-            if (good) {
-                good = try_instantiate(rel->getPowerInner(), form->getPowerInner(), new_instantiation, iincr(debug));
-                if (good) {
-                    instantiation = new_instantiation;
-                }
+            if (try_instantiate(rel->getPower(), form->getPowerS(), variables, iincr(debug))
+                && try_instantiate(rel->getPowerInner(), form->getPowerInner(), variables, iincr(debug))) {
+                return true;
             }
-            return good;
+            variables.undo(marked);
+            return false;
         } else if (rel->isProduct() && form->isProduct()) {
             if ((rel->getProductSize() == 1) && (form->getProductSize() == 1)) {
-                return try_instantiate(rel->getProductElem(0), form->getProductElem(0), instantiation, iincr(debug));
+                return try_instantiate(rel->getProductElem(0), form->getProductElem(0), variables, iincr(debug));
             }
             /* Try all combinations... is there a better way? */
-            vector<HFormula> rel_product, form_product;
-            for (size_t idx=0; idx<rel->getProductSize(); idx++) {
-                HFormula formula = rel->getProductElem(idx);
-                size_t n_times = 1;
-                if (formula.get()->isPower()) {
-                    n_times = formula.get()->getPower();
-                    formula = formula.get()->getPowerInner();
-                }
-                for (size_t times=0; times<n_times; times++) {
-                    rel_product.push_back(formula);
-                }
-            }
-            for (size_t idx=0; idx<form->getProductSize(); idx++) {
-                HFormula formula = form->getProductElem(idx);
-                size_t n_times = 1;
-                if (formula.get()->isPower()) {
-                    n_times = formula.get()->getPower();
-                    formula = formula.get()->getPowerInner();
-                }
-                for (size_t times=0; times<n_times; times++) {
-                    form_product.push_back(formula);
-                }
-            }
-            if(rel_product.size() != form_product.size()) {
+            const HFormula* rel_product[MAX_PRODUCT_LEAVES];
+            const HFormula* form_product[MAX_PRODUCT_LEAVES];
+            size_t rel_size = flatten_product(rel, rel_product);
+            size_t form_size = flatten_product(form, form_product);
+            if(rel_size != form_size) {
                 return false; /* Since we flatten the product, it should have the same size */
             }
-            return try_instantiate_product(rel_product, form_product, instantiation, iincr(debug));
+            uint32_t all = (rel_size == 32) ? ~0u : (1u << rel_size) - 1;
+            return try_instantiate_product(rel_product, all, form_product, all, variables, iincr(debug));
         } else if (rel->isZeta() && form->isZeta()) {
-            return try_instantiate(rel->getZetaExponentS(), form->getZetaExponentS(), instantiation, iincr(debug));
+            return try_instantiate(rel->getZetaExponentS(), form->getZetaExponentS(), variables, iincr(debug));
         } else if (rel->isLFuncNonZeta() && form->isLFuncNonZeta()) {
-            SymbolicInstantiation new_instantiation = instantiation;
-            bool good1 = try_instantiate(rel->getLFuncExponentS(), form->getLFuncExponentS(), new_instantiation, iincr(debug));
-            bool good2 = try_instantiate(rel->getLFuncProduct(), form->getLFuncProduct(), new_instantiation, iincr(debug));
+            bool good1 = try_instantiate(rel->getLFuncExponentS(), form->getLFuncExponentS(), variables, iincr(debug));
+            bool good2 = try_instantiate(rel->getLFuncProduct(), form->getLFuncProduct(), variables, iincr(debug));
             if (good2 && !good1) {
                 /* See e.g. C13. Else we always fall in the "more than one non-instantiated var, which is not handled above */
-                good1 = try_instantiate(rel->getLFuncExponentS(), form->getLFuncExponentS(), new_instantiation, iincr(debug));
+                good1 = try_instantiate(rel->getLFuncExponentS(), form->getLFuncExponentS(), variables, iincr(debug));
             }
             bool good = good1 && good2;
-            if (good) {
-                instantiation = new_instantiation;
+            if (!good) {
+                variables.undo(marked);
             }
             return good;
         }
@@ -644,58 +676,69 @@ private:
         return false; /* We could not do it. This does not mean this is not doable */
     }
 
-    bool try_instantiate_e(Element rel, const Element& form, SymbolicInstantiation& instantiation, Rational& rel_power, int debug) const {
+    bool try_instantiate_e(const HFormula& rel, const Rational& rel_elem_power, const HFormula& form, const Rational& form_power,
+                           SymbolicInstantiation::assignment& variables, Rational& rel_power, int debug) const {
         if (debug>=0) {
             cerr << string(debug, ' ') << __func__ << " TI ";
-            print_element(cerr, false, rel, false);
+            print_element(cerr, false, Element(rel, rel_elem_power), false);
             cerr << " wrt ";
-            print_element(cerr, false, form, false);
+            print_element(cerr, false, Element(form, form_power), false);
             cerr << endl;
         }
-        if (rel.second == form.second) {
+        if (rel_elem_power == form_power) {
             /* OK */
-        } else if (is_positive(rel.second) && is_positive(form.second) && (rel.second > form.second)) {
+        } else if (is_positive(rel_elem_power) && is_positive(form_power) && (rel_elem_power > form_power)) {
             /* We might have ζ(4)^2 w.r.t ζ(a)ζ(b), so me must match partial powers on 'rel' side. */
-            rel.second = form.second;
-        } else if (!is_positive(rel.second) && !is_positive(form.second) && (rel.second < form.second)) {
+        } else if (!is_positive(rel_elem_power) && !is_positive(form_power) && (rel_elem_power < form_power)) {
             /* Same as above but for negative powers */
-            rel.second = form.second;
         } else {
             if (debug>=0) { cerr << string(debug, ' ') << __func__ << KGRY " TI DIFF-PWR" KRST << endl; }
             return false;
         }
 
-        bool good = try_instantiate(rel.first, form.first, instantiation, iincr(debug));
+        bool good = try_instantiate(rel, form, variables, iincr(debug));
         if (good) {
-            rel_power = rel.second;
+            rel_power = form_power;
         }
         return good;
     }
 
+    /*
+     * Backtracking search: every element of the formula left is tried against
+     * every element of the relation left, relation elements first, then the
+     * remainders of those partially matched, the latest first. A branch undoes
+     * its changes to `instantiation` when it fails, instead of working on a
+     * copy; on success, `instantiation` holds the match.
+     */
     bool is_instance_of(SymbolicInstantiation& instantiation, int debug) const {
         if (debug>=0) cerr << string(debug, ' ') << __func__ << " IIO*" << endl;
-        if (instantiation.relation_elements.size() == 0) {
-            if (instantiation.formula_elements.size() == 0) {
+        SymbolicInstantiation::Side& rel_side = instantiation.relation_elements;
+        SymbolicInstantiation::Side& form_side = instantiation.formula_elements;
+        if (rel_side.left == 0) {
+            if (form_side.left == 0) {
                 return true; /* YA RLY! */
             } else {
                 /* It matches if every variable has been instantiated and the remaining product equals 1 */
-                std::vector<Element> up, down;
+                SymbolicInstantiation new_instantiation;
+                SymbolicInstantiation::Side& up = new_instantiation.relation_elements;
+                SymbolicInstantiation::Side& down = new_instantiation.formula_elements;
                 Rational sum = 0;
-                for (const Element* element: instantiation.formula_elements) {
-                    sum += element->second;
-                    if (is_positive(element->second)) {
-                        up.push_back(*element);
+                for (uint64_t forms = form_side.left; forms != 0; forms &= forms - 1) {
+                    size_t slot = __builtin_ctzll(forms);
+                    const Rational& power = form_side.powers[slot];
+                    sum += power;
+                    if (is_positive(power)) {
+                        up.add(*form_side.formulas[slot], power);
                     } else {
-                        Element new_elem = *element;
-                        new_elem.second = -new_elem.second;
-                        down.push_back(new_elem);
+                        down.add(*form_side.formulas[slot], -power);
                     }
                 }
-                if ((up.size() == 0) || (down.size() == 0)) {
+                up.nb_elements = up.nb_slots;
+                down.nb_elements = down.nb_slots;
+                if ((up.nb_slots == 0) || (down.nb_slots == 0)) {
                     return false;
                 }
                 if (sum == Rational(0)) {
-                    SymbolicInstantiation new_instantiation = SymbolicInstantiation(up, down);
                     new_instantiation.variables = instantiation.variables;
                     if (is_instance_of(new_instantiation, iincr(debug))) {
                         /* Check if no new variable was introduced, i.e. there was no non-instantiated variable */
@@ -705,24 +748,39 @@ private:
                 return false;
             }
         }
-        assert(instantiation.formula_elements.size() > 0);
-
-        for (auto form_elem: instantiation.formula_elements) {
-            for (auto rel_elem: instantiation.relation_elements) {
-                SymbolicInstantiation new_instantiation = instantiation;
-                Rational rel_power;
-                if (try_instantiate_e(*rel_elem, *form_elem, new_instantiation, rel_power, iincr(debug))) {
-                    Element new_rel_elem = *rel_elem;
-                    new_instantiation.relation_elements.erase(rel_elem);
-                    if (rel_power != rel_elem->second) {
-                        new_rel_elem.second = new_rel_elem.second - rel_power;
-                        new_instantiation.relation_elements.insert(&new_rel_elem);
-                    }
-                    new_instantiation.formula_elements.erase(form_elem);
-                    if (is_instance_of(new_instantiation, iincr(debug))) {
-                        instantiation = new_instantiation;
-                        return true; /* NO WAI!! */
+        assert(form_side.left != 0);
+
+        const uint64_t rel_left = rel_side.left;
+        const uint64_t form_left = form_side.left;
+        const uint64_t rel_elements = rel_left & ((rel_side.nb_elements == 64) ? ~0ull : (1ull << rel_side.nb_elements) - 1);
+        const uint64_t rel_remainders = rel_left & ~rel_elements;
+        for (uint64_t forms = form_left; forms != 0; forms &= forms - 1) {
+            size_t form_slot = __builtin_ctzll(forms);
+            for (int pass = 0; pass < 2; pass++) {
+                uint64_t rels = (pass == 0) ? rel_elements : rel_remainders;
+                while (rels != 0) {
+                    size_t rel_slot = (pass == 0) ? __builtin_ctzll(rels) : 63 - __builtin_clzll(rels);
+                    rels &= ~(1ull << rel_slot);
+
+                    uint32_t marked = instantiation.variables.mark();
+                    Rational rel_power;
+                    if (try_instantiate_e(*rel_side.formulas[rel_slot], rel_side.powers[rel_slot],
+                                          *form_side.formulas[form_slot], form_side.powers[form_slot],
+                                          instantiation.variables, rel_power, iincr(debug))) {
+                        size_t nb_slots = rel_side.nb_slots;
+                        rel_side.left &= ~(1ull << rel_slot);
+                        if (rel_power != rel_side.powers[rel_slot]) {
+                            rel_side.add(*rel_side.formulas[rel_slot], rel_side.powers[rel_slot] - rel_power);
+                        }
+                        form_side.left &= ~(1ull << form_slot);
+                        if (is_instance_of(instantiation, iincr(debug))) {
+                            return true; /* NO WAI!! */
+                        }
+                        rel_side.left = rel_left;
+                        rel_side.nb_slots = nb_slots;
+                        form_side.left = form_left;
                     }
+                    instantiation.variables.undo(marked);
                 }
             }
         }
@@ -730,22 +788,17 @@ private:
         return false; /* Could not find a valid instantiation */
     }
 
-    bool is_instance_of(RelationSummary::instance_early_bailout early_bailout, const RelationSummary& summary,
-                        const Relation& formula, SymbolicInstantiation::assignment* assignment, int debug) {
+    bool is_instance_of(const Relation& formula, SymbolicInstantiation::assignment* assignment, int debug) {
         if (debug>=0) cerr << string(debug, ' ') << __func__ << " IIO " << *this << " wrt "<< formula << endl;
-        if (formula.elements.size() < elements.size()) {
-            return false;
-        }
-        if (!early_bailout(summary)) {
-            return false;
-        }
         SymbolicInstantiation instantiation = SymbolicInstantiation(elements, formula.elements);
         bool good = is_instance_of(instantiation, iincr(debug));
         if (good && (assignment != NULL)) {
 #if 0
             cerr << KRED << "Assignment:";
-            for (auto it = instantiation.variables.begin(); it != instantiation.variables.end(); it++) {
-                cerr << " " << it->first << ':' << it->second << " ";
+            for (int var = 0; var < FormulaNode::Symbolic::NB_VARIABLES; var++) {
+                if (instantiation.variables.has(var)) {
+                    cerr << " " << (char)('a' + var) << ':' << instantiation.variables[var] << " ";
+                }
             }
             cerr << KRST << endl;
 #endif
@@ -754,186 +807,142 @@ private:
         return good;
     }
 
-    typedef bool(Relation::*relation_classifier)(const RelationSummary&, string&);
+    /*
+     * A known formula for classify(). Patterns are built once, in the order
+     * they are tried, so classifying a relation only runs the matcher.
+     */
+    struct ClassifierPattern {
+        std::string name;
+        std::shared_ptr<const Relation> formula; /* NULL when built per number of zeta, see zeta_count_formula() */
+        RelationSummary summary; /* Of the formula, to dispatch relations */
+        RelationSummary::instance_early_bailout early_bailout;
+        /* Reported as `alias` when `alias_var` (the number of zeta if empty) is instantiated to `alias_value` */
+        std::string alias_var;
+        int alias_value = 0;
+        std::string alias;
+
+        ClassifierPattern alias_when(const std::string& var, int value, const std::string& alias_name) const {
+            ClassifierPattern aliased = *this;
+            aliased.alias_var = var;
+            aliased.alias_value = value;
+            aliased.alias = alias_name;
+            return aliased;
+        }
+        ClassifierPattern alias_when(int nb_zeta, const std::string& alias_name) const {
+            return alias_when("", nb_zeta, alias_name);
+        }
+    };
 
-    bool check_D3(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-3";
-        vector<pair<HFormula, Rational>> vect{
-            {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
-                FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0})),
-                FormulaNode::Symbolic("s")), Rational(1)},
-            {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-2)},
-        };
+    static ClassifierPattern formula_pattern(const std::string& name, const vector<pair<HFormula, Rational>>& vect,
+                                             RelationSummary::instance_early_bailout early_bailout = RelationSummary::no_early_bailout) {
         Relation formula = Relation(vect);
         formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
+        ClassifierPattern pattern;
+        pattern.name = name;
+        pattern.formula = std::make_shared<const Relation>(formula);
+        pattern.summary = RelationSummary(formula.elements);
+        pattern.early_bailout = early_bailout;
+        return pattern;
+    }
+
+    static ClassifierPattern zeta_count_pattern(const std::string& name) {
+        ClassifierPattern pattern;
+        pattern.name = name;
+        /* The leaf types and the number of elements do not depend on the number of zeta */
+        pattern.summary = RelationSummary(zeta_count_formula(name, 2).elements);
+        pattern.early_bailout = RelationSummary::no_early_bailout;
+        return pattern;
+    }
+
+    /* D-12 for a relation with `nb_zeta` zeta: built on first use, then shared */
+    static const Relation& zeta_count_formula(const std::string& name, int nb_zeta) {
+        static std::mutex formulas_mutex;
+        static std::map<int, Relation> formulas;
+        std::lock_guard<std::mutex> lock(formulas_mutex);
+        auto it = formulas.find(nb_zeta);
+        if (it == formulas.end()) {
+            vector<pair<HFormula, Rational>> vect{
+                {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
+                    FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = nb_zeta, .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
+                {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-nb_zeta)},
+            };
+            Relation formula = Relation(vect);
+            formula.classify_raw(name);
+            it = formulas.insert({nb_zeta, formula}).first;
+        }
+        return it->second;
     }
 
-    bool check_D6(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-6";
-        vector<pair<HFormula, Rational>> vect{
+    static std::vector<ClassifierPattern> build_classifier_patterns() {
+        std::vector<ClassifierPattern> patterns;
+        /*
+            * D formulae,
+            * from Gould, H. W., & Shonhiwa, T. (2008). A catalog of interesting Dirichlet series.
+            * Missouri Journal of Mathematical Sciences, 20(1), 2-18.
+            */
+
+        /* D-1 we won't find */
+        /* Check for D-2: handled in D-22 */
+        /* Check for D-3: handled in D-12 */
+        /* Check for D-4: handled in D-6 */
+        /* Check for D-5: handled in D-52 */
+        patterns.push_back(formula_pattern("D-6", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})),
                 FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        SymbolicInstantiation::assignment assignment;
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, &assignment, -1);
-        if (!good) {
-            return false;
-        }
-        out_name = name;
-        if (assignment["k"] == 1) {
-            out_name = "D-4";
-        }
-        return good;
-    }
-
-    bool check_D10(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-10";
-        vector<pair<HFormula, Rational>> vect{
+        }).alias_when("k", 1, "D-4"));
+        /* D-7 & D-8 we won't find */
+        /* Check for D-9: this is D-18 */
+        patterns.push_back(formula_pattern("D-10", {
             {HFormulaLFunction(HFormulaProduct(HFormulaPower(
                 HFormulaLeaf(FormulaNode::LEAF_MU, (FormulaNode::LeafExtraArg){.k = 1, .l = 0}), 2)), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D11(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-11";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-11", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaPower(HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}), 2)),
                 FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-4)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D12(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-12";
-        Rational nb_zeta = summary.zeta;
-        if (nb_zeta.getDenominator() != 1) {
-            return false;
-        }
-        int nb_zeta_int = nb_zeta.getNumerator().to_int();
-        vector<pair<HFormula, Rational>> vect{
-            {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
-                FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = nb_zeta_int, .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
-            {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), -nb_zeta},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        if (nb_zeta_int == 2) {
-            out_name = "D-3";
-        }
-        return good;
-    }
-
-    bool check_D15(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-15";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(zeta_count_pattern("D-12").alias_when(2, "D-3"));
+        /* Check for D-13: handled in D-15 */
+        /* D-14 we won't find */
+        patterns.push_back(formula_pattern("D-15", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_ZETAK, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        SymbolicInstantiation::assignment assignment;
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, &assignment, -1);
-        if (!good) {
-            return false;
-        }
-        out_name = name;
-        if (assignment["k"] == 1) {
-            out_name = "D-13";
-        }
-        return good;
-    }
-
-    bool check_D18(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-18";
-        vector<pair<HFormula, Rational>> vect{
+        }).alias_when("k", 1, "D-13"));
+        /* D-16 & D-17 we won't find */
+        patterns.push_back(formula_pattern("D-18", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(FormulaNode::LEAF_THETA)), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-2)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D21(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-21";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        /* D-19 & D-20 we won't find */
+        patterns.push_back(formula_pattern("D-21", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE), HFormulaLeaf(FormulaNode::LEAF_THETA)),
                                FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(2)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D22(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-22";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-22", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_MU, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("k*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        SymbolicInstantiation::assignment assignment;
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, &assignment, -1);
-        out_name = name;
-        if (assignment["k"] == 1) {
-            out_name = "D-2";
-        }
-        return good;
-    }
-
-    bool check_D24(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-24";
-                vector<pair<HFormula, Rational>> vect{
+        }).alias_when("k", 1, "D-2"));
+        /* D-23 PHI_K not implemented */          // TODO
+        patterns.push_back(formula_pattern("D-24", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_XI, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})),
                 FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("k*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D25(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-25";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-25", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})),
@@ -941,34 +950,15 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D26(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-26";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-26", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_PSI, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    /* Warning: formula in the catalog is wrong! */
-    bool check_D27(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-27";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-27", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
@@ -977,63 +967,32 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-2*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D28(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-28";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-28", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_NU, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("k*s")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-
-    bool check_D30(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-30";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        /* D-29 form is not handled by checker */ // TODO
+        patterns.push_back(formula_pattern("D-30", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_RHO, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = FormulaNode::Symbolic("t")})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("t*s")), Rational(-1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
+        }));
+        /* D-31 we won't find */
+
+        /* ... */
 
-    bool check_D37(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-37";
-                vector<pair<HFormula, Rational>> vect{
+        /* D-35 and D-36 we won't find */
+        patterns.push_back(formula_pattern("D-37", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-2*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D38(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-38";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-38", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("h"), .l = 0}),
@@ -1047,23 +1006,11 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s+-2*h+-2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.liouville == Rational(1)) && (r.sigma_prime == Rational(1)) && (r.sigma == Rational(1))
                 && ((r.zeta == Rational(8)) || (r.zeta == Rational(6)));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D39(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-39";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-39", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("h"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
@@ -1075,23 +1022,11 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-h")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k+-h")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s+-2*h+-2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.sigma == Rational(1)) && (r.sigma_prime == Rational(1))
                 && ((r.zeta == Rational(8)) || (r.zeta == Rational(6)));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D40(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-40";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-40", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("h"), .l = 0}),
@@ -1103,23 +1038,11 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s+-2*h+-2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.liouville == Rational(1)) && (r.sigma_prime == Rational(1)) && (r.sigma == Rational(1))
                 && (r.zeta == Rational(6));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D41(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-41";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-41", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("h"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})),
@@ -1131,23 +1054,11 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-h+-k")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-h")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.sigma_prime == Rational(2))
                 && ((r.zeta == Rational(7)) || (r.zeta == Rational(5)));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D42(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-42";
-                vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-42", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("h"), .l = 0}),
@@ -1160,22 +1071,11 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-h+-k")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-h+-k")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.liouville == Rational(1)) && (r.sigma_prime == Rational(2))
                 && ((r.zeta == Rational(7)) || (r.zeta == Rational(5)));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-    bool check_C43(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-43";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-43", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_NU, (FormulaNode::LeafExtraArg){.k = 2, .l = 0})
@@ -1183,17 +1083,9 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-2*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-    
-    bool check_D46(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-46";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        /* D-44 and D-45 we won't find */
+        patterns.push_back(formula_pattern("D-46", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("h"), .l = 0}),
@@ -1208,23 +1100,11 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-h")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-h+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.liouville == Rational(1)) && (r.sigma == Rational(2))
                 && ((r.zeta == Rational(9)) || (r.zeta == Rational(7)) || (r.zeta == Rational(5)));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D47(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-47";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-47", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
@@ -1233,39 +1113,22 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-2*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.liouville == Rational(1)) && (r.sigma == Rational(1));
-        };
+        }));
+        /* D-48 we won't find */
 
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
+        /* ... */
 
-    bool check_D50(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-50";
-        vector<pair<HFormula, Rational>> vect{
+        patterns.push_back(formula_pattern("D-50", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaPower(HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}), 2)
                 ), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-3)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(4)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D51(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-51";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-51", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_NU, (FormulaNode::LeafExtraArg){.k = 2, .l = 0})
@@ -1274,72 +1137,31 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s+-2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D52(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-52";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("D-52", {
             {HFormulaLFunction(HFormulaProduct(HFormulaLeaf(
                 FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        SymbolicInstantiation::assignment assignment;
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, &assignment, -1);
-        if (!good) {
-            return false;
-        }
-        out_name = name;
-        if (assignment["k"] == 1) {
-            out_name = "D-5";
-        }
-        return good;
-    }
-
-    bool check_D53(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-53";
-        vector<pair<HFormula, Rational>> vect{
+        }).alias_when("k", 1, "D-5"));
+        patterns.push_back(formula_pattern("D-53", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaPower(HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE), 1)),
                 FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-    
-    bool check_D55(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-55";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        /* D-54 we won't find */
+        patterns.push_back(formula_pattern("D-55", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_NU, (FormulaNode::LeafExtraArg){.k = 2, .l = 0})
                 ), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-3)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_D58(const RelationSummary& summary, string& out_name) {
-        std::string name = "D-58";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        /* D-56 & D-57 we won't find */
+        patterns.push_back(formula_pattern("D-58", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("a"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("b"), .l = 0})
@@ -1349,39 +1171,23 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-b")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-a+-b")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-a+-b")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-
-        RelationSummary::instance_early_bailout early_bailout = [](const RelationSummary&r) {
+        }, [](const RelationSummary&r) {
             return (r.sigma == Rational(2)) && (r.zeta == Rational(5));
-        };
-
-        bool good = is_instance_of(early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
+        }));
+        /* D-59 and later we won't find */
 
-    bool check_C1(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-1";
-        vector<pair<HFormula, Rational>> vect{
+        /*
+         * C formulae, found with CrazySums
+         */
+        patterns.push_back(formula_pattern("C-1", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("s"), .l = 0}),
                 HFormulaPower(HFormulaLeaf(FormulaNode::LEAF_MU, (FormulaNode::LeafExtraArg){.k = 1, .l = 0}), 2)
                 ), FormulaNode::Symbolic("2*s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("3*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C11(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-11";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-11", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("s"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_MU, (FormulaNode::LeafExtraArg){.k = 1, .l = 0})
@@ -1390,17 +1196,8 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("3*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("6*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C13(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-13";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-13", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("i"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("i"), .l = 0})
@@ -1411,17 +1208,8 @@ private:
                 ), FormulaNode::Symbolic("3*i+2*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*i+2*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("i+2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C14(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-14";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-14", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_THETA),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("s"), .l = 0})
@@ -1430,17 +1218,8 @@ private:
                 HFormulaPower(HFormulaLeaf(FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("s"), .l = 0}), 2)
                 ), FormulaNode::Symbolic("4*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-2)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C15(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-15";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-15", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("s"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("s"), .l = 0})
@@ -1454,34 +1233,16 @@ private:
                 ), FormulaNode::Symbolic("5*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("3*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C17(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-17";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-17", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0})),
                 FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(2)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C18(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-18";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-18", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
@@ -1489,17 +1250,8 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(-2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(-2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C19(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-19";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-19", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}),
@@ -1510,17 +1262,9 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
+        }));
 
-    bool check_C24(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-24";
-        vector<pair<HFormula, Rational>> vect{
+        patterns.push_back(formula_pattern("C-24", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_SIGMA_PRIME, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
@@ -1530,17 +1274,8 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s+-k")), Rational(2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s+-2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C25(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-25";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-25", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_TAUK, (FormulaNode::LeafExtraArg){.k = 2, .l = 0}),
@@ -1551,17 +1286,9 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s+-k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("4*s+-2*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
+        }));
 
-    bool check_C27(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-27";
-        vector<pair<HFormula, Rational>> vect{
+        patterns.push_back(formula_pattern("C-27", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_XI, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
@@ -1569,17 +1296,8 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C28(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-28";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-28", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_LIOUVILLE),
                 HFormulaLeaf(FormulaNode::LEAF_XI, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
@@ -1588,162 +1306,191 @@ private:
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("k*s")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*s*k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C29(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-29";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-29", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_JORDAN_T, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0}),
                 HFormulaLeaf(FormulaNode::LEAF_NU, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("l"), .l = 0})
                 ), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("l*s+-l*k")), Rational(-1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("l*s+-k*l+k")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
-    }
-
-    bool check_C30(const RelationSummary& summary, string& out_name) {
-        std::string name = "C-30";
-        vector<pair<HFormula, Rational>> vect{
+        }));
+        patterns.push_back(formula_pattern("C-30", {
             {HFormulaLFunction(HFormulaProduct(
                 HFormulaLeaf(FormulaNode::LEAF_THETA),
                 HFormulaLeaf(FormulaNode::LEAF_NU, (FormulaNode::LeafExtraArg){.k = FormulaNode::Symbolic("k"), .l = 0})
                 ), FormulaNode::Symbolic("s")), Rational(1)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("k*s")), Rational(-2)},
             {HFormulaLFunction(HFormulaOne(), FormulaNode::Symbolic("2*k*s")), Rational(1)},
-        };
-        Relation formula = Relation(vect);
-        formula.classify_raw(name);
-        bool good = is_instance_of(RelationSummary::no_early_bailout, summary, formula, NULL, -1);
-        out_name = name;
-        return good;
+        }));
+        return patterns;
     }
 
+    /* Counted by classify_known() for each pattern tried, when classifier_stats_enabled() */
+    struct ClassifierCounters {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> bailouts{0}; /* Rejected before the search, e.g. by the early bailout */
+        std::atomic<uint64_t> matches{0};
+        std::atomic<uint64_t> nanoseconds{0};
+    };
 
-    vector<relation_classifier> classifiers{
-        /*
-            * D formulae,
-            * from Gould, H. W., & Shonhiwa, T. (2008). A catalog of interesting Dirichlet series.
-            * Missouri Journal of Mathematical Sciences, 20(1), 2-18.
-            */
-
-        /* D-1 we won't find */
-        /* Check for D-2: handled in D-22 */
-        /* Check for D-3: handled in D-12 */
-        /* Check for D-4: handled in D-6 */
-        /* Check for D-5: handled in D-52 */
-        &Relation::check_D6,
-        /* D-7 & D-8 we won't find */
-        /* Check for D-9: this is D-18 */
-        &Relation::check_D10,
-        &Relation::check_D11,
-        &Relation::check_D12,
-        /* Check for D-13: handled in D-15 */
-        /* D-14 we won't find */
-        &Relation::check_D15,
-        /* D-16 & D-17 we won't find */
-        &Relation::check_D18,
-        /* D-19 & D-20 we won't find */
-        &Relation::check_D21,
-        &Relation::check_D22,
-        /* D-23 PHI_K not implemented */          // TODO
-        &Relation::check_D24,
-        &Relation::check_D25,
-        &Relation::check_D26,
-        &Relation::check_D27,
-        &Relation::check_D28,
-        /* D-29 form is not handled by checker */ // TODO
-        &Relation::check_D30,
-        /* D-31 we won't find */
-
-        /* ... */
+    static std::atomic<bool>& classifier_stats_flag() {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+
+    /*
+     * The patterns, indexed by the leaf types of their L-functions: a relation
+     * is only tried against the patterns that may_match() it, in table order.
+     */
+    struct ClassifierIndex {
+        std::vector<ClassifierPattern> patterns;
+        std::unordered_map<uint32_t, std::vector<size_t>> by_leaf_types; /* Patterns with a single L-function */
+        std::vector<size_t> by_subset; /* The others, which match relations using some of their leaf types */
+        std::unique_ptr<ClassifierCounters[]> counters; /* By pattern, see enable_classifier_stats() */
+
+        ClassifierIndex(const std::vector<ClassifierPattern>& all_patterns)
+            : patterns(all_patterns), counters(new ClassifierCounters[all_patterns.size()]) {
+            for (size_t id = 0; id < patterns.size(); id++) {
+                if (patterns[id].summary.nb_lfuncs == 1) {
+                    by_leaf_types[patterns[id].summary.leaf_types].push_back(id);
+                } else {
+                    by_subset.push_back(id);
+                }
+            }
+        }
 
-        /* D-35 and D-36 we won't find */
-        &Relation::check_D37,
-        &Relation::check_D38,
-        &Relation::check_D39,
-        &Relation::check_D40,
-        &Relation::check_D41,
-        &Relation::check_D42,
-        &Relation::check_C43,
-        /* D-44 and D-45 we won't find */
-        &Relation::check_D46,
-        &Relation::check_D47,
-        /* D-48 we won't find */
+        std::vector<size_t> candidates(const RelationSummary& relation) const {
+            std::vector<size_t> exact, subset, ids;
+            auto it = by_leaf_types.find(relation.leaf_types);
+            if (it != by_leaf_types.end()) {
+                for (size_t id: it->second) {
+                    if (patterns[id].summary.may_match(relation)) {
+                        exact.push_back(id);
+                    }
+                }
+            }
+            for (size_t id: by_subset) {
+                if (patterns[id].summary.may_match(relation)) {
+                    subset.push_back(id);
+                }
+            }
+            std::merge(exact.begin(), exact.end(), subset.begin(), subset.end(), std::back_inserter(ids));
+            return ids;
+        }
+    };
 
-        /* ... */
+    static const ClassifierIndex& classifier_index() {
+        static const ClassifierIndex index(build_classifier_patterns());
+        return index;
+    }
 
-        &Relation::check_D50,
-        &Relation::check_D51,
-        &Relation::check_D52,
-        &Relation::check_D53,
-        /* D-54 we won't find */
-        &Relation::check_D55,
-        /* D-56 & D-57 we won't find */
-        &Relation::check_D58,
-        /* D-59 and later we won't find */
+    enum MatchResult { MATCH_BAILED_OUT, MATCH_NONE, MATCH_FOUND };
 
-        /*
-         * C formulae, found with CrazySums
-         */
-        &Relation::check_C1,
-        &Relation::check_C11,
-        &Relation::check_C13,
-        &Relation::check_C14,
-        &Relation::check_C15,
-        &Relation::check_C17,
-        &Relation::check_C18,
-        &Relation::check_C19,
-
-        &Relation::check_C24,
-        &Relation::check_C25,
-
-        &Relation::check_C27,
-        &Relation::check_C28,
-        &Relation::check_C29,
-        &Relation::check_C30,
-    };
+    MatchResult match(const ClassifierPattern& pattern, const RelationSummary& summary, string& out_name) {
+        const Relation* formula = pattern.formula.get();
+        int nb_zeta_int = 0;
+        if (formula == NULL) {
+            Rational nb_zeta = summary.zeta;
+            if (nb_zeta.getDenominator() != 1) {
+                return MATCH_BAILED_OUT;
+            }
+            nb_zeta_int = nb_zeta.getNumerator().to_int();
+            formula = &zeta_count_formula(pattern.name, nb_zeta_int);
+        }
+        if ((formula->elements.size() < elements.size()) || !pattern.early_bailout(summary)) {
+            return MATCH_BAILED_OUT;
+        }
+        SymbolicInstantiation::assignment assignment;
+        if (!is_instance_of(*formula, &assignment, -1)) {
+            return MATCH_NONE;
+        }
+        out_name = pattern.name;
+        if (!pattern.alias.empty()) {
+            bool aliased;
+            if (pattern.alias_var.empty()) {
+                aliased = (nb_zeta_int == pattern.alias_value);
+            } else {
+                int var = pattern.alias_var[0] - 'a';
+                aliased = assignment.has(var) && (assignment[var] == pattern.alias_value);
+            }
+            if (aliased) {
+                out_name = pattern.alias;
+            }
+        }
+        return MATCH_FOUND;
+    }
 
-public:
-    void classify() {
+    void classify_known() {
         const RelationSummary summary(elements);
-        #if DEBUG_TIME_CLASSIFY
-        size_t classify_debug_idx = 0;
-        #endif /* DEBUG_TIME_CLASSIFY */
-        for (auto classifier: classifiers) {
-            #if DEBUG_TIME_CLASSIFY
-            auto t1 = std::chrono::high_resolution_clock::now();
-            #endif /* DEBUG_TIME_CLASSIFY */
+        const ClassifierIndex& index = classifier_index();
+        const bool stats = classifier_stats_enabled();
+        for (size_t id: index.candidates(summary)) {
+            const ClassifierPattern& pattern = index.patterns[id];
+            std::chrono::steady_clock::time_point start;
+            if (stats) {
+                start = std::chrono::steady_clock::now();
+            }
             std::string found_formula;
-            if ((this->*classifier)(summary, found_formula)) {
+            MatchResult result = match(pattern, summary, found_formula);
+            if (stats) {
+                ClassifierCounters& counters = index.counters[id];
+                uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                counters.calls.fetch_add(1, std::memory_order_relaxed);
+                counters.bailouts.fetch_add(result == MATCH_BAILED_OUT, std::memory_order_relaxed);
+                counters.matches.fetch_add(result == MATCH_FOUND, std::memory_order_relaxed);
+                counters.nanoseconds.fetch_add(elapsed, std::memory_order_relaxed);
+            }
+            if (result == MATCH_FOUND) {
                 known_formula = found_formula;
                 known = true;
-            }
-            #if DEBUG_TIME_CLASSIFY
-            auto t2 = std::chrono::high_resolution_clock::now();
-            std::chrono::duration<float> e21 = t2 - t1;
-            if (classify_debug_idx >= relation_time_classify_debug.size()) {
-                assert(classify_debug_idx == relation_time_classify_debug.size());
-                relation_time_classify_debug.push_back(e21);
-            } else {
-                relation_time_classify_debug[classify_debug_idx] += e21;
-            }
-            classify_debug_idx++;
-            #endif /* DEBUG_TIME_CLASSIFY */
-            if (known) {
                 return;
             }
         }
     }
+
+public:
+    void classify() {
+        classify_known();
+        sort_key = make_sort_key();
+    }
+
+    /* Per-classifier counters, off by default: they cost two clock reads per pattern tried */
+    static void enable_classifier_stats() {
+        classifier_stats_flag() = true;
+    }
+    static bool classifier_stats_enabled() {
+        return classifier_stats_flag();
+    }
+
+    static void print_classifier_stats(std::ostream& out) {
+        const ClassifierIndex& index = classifier_index();
+        out << std::left << std::setw(12) << "Classifier" << std::right
+            << std::setw(10) << "calls" << std::setw(10) << "bailouts" << std::setw(10) << "matches"
+            << std::setw(12) << "total (s)" << std::setw(12) << "mean (us)" << endl;
+        for (size_t id = 0; id < index.patterns.size(); id++) {
+            const ClassifierCounters& counters = index.counters[id];
+            uint64_t calls = counters.calls;
+            double total = counters.nanoseconds * 1e-9;
+            out << std::left << std::setw(12) << index.patterns[id].name << std::right
+                << std::setw(10) << calls << std::setw(10) << counters.bailouts << std::setw(10) << counters.matches
+                << std::setw(12) << total << std::setw(12) << (calls ? total * 1e6 / calls : 0.) << endl;
+        }
+    }
+
+    static void print_classifier_stats_json(std::ostream& out) {
+        const ClassifierIndex& index = classifier_index();
+        out << "{\"classifiers\": [";
+        for (size_t id = 0; id < index.patterns.size(); id++) {
+            const ClassifierCounters& counters = index.counters[id];
+            uint64_t calls = counters.calls;
+            double total = counters.nanoseconds * 1e-9;
+            out << (id ? ",\n  " : "\n  ")
+                << "{\"name\": \"" << index.patterns[id].name << "\", \"calls\": " << calls
+                << ", \"bailouts\": " << counters.bailouts << ", \"matches\": " << counters.matches
+                << ", \"total_s\": " << total << ", \"mean_us\": " << (calls ? total * 1e6 / calls : 0.) << "}";
+        }
+        out << "\n]}" << endl;
+    }
 };